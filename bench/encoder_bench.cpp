@@ -0,0 +1,270 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Hot path kernels: encoded MPSSE command bytes per second for the bulk
+// encoders, SIMD and scalar, plus reverseByte() and the verify compare over
+// ROM bytes. Also checks both encoders produce the same stream. Prints one
+// JSON object per kernel.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "encoder.hpp"
+
+const int blockSize = 64 * 1024;
+const int iterations = 64;
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+    .count();
+}
+
+typedef int (*ProgramEncoder)(
+  CommandBuffer *, const ProgramTemplate *, int, const uint8_t *, int, int);
+typedef void (*ReadEncoder)(CommandBuffer *, int, int, uint8_t);
+
+double benchProgram(ProgramEncoder encode,
+                    CommandBuffer *cb,
+                    const ProgramTemplate *t,
+                    const uint8_t *src) {
+  auto start = std::chrono::steady_clock::now();
+  int64_t bytes = 0;
+  for (int i = 0; i < iterations; i++) {
+    cb->pos = 0;
+    encode(cb, t, i * blockSize, src, blockSize, 0);
+    bytes += cb->pos;
+  }
+  return bytes / secondsSince(start);
+}
+
+double benchRead(ReadEncoder encode, CommandBuffer *cb) {
+  auto start = std::chrono::steady_clock::now();
+  int64_t bytes = 0;
+  for (int i = 0; i < iterations; i++) {
+    cb->pos = 0;
+    encode(cb, i * blockSize, blockSize, 1);
+    bytes += cb->pos;
+  }
+  return bytes / secondsSince(start);
+}
+
+double benchDuplexRead(CommandBuffer *cb) {
+  auto start = std::chrono::steady_clock::now();
+  int64_t bytes = 0;
+  for (int i = 0; i < iterations; i++) {
+    cb->pos = 0;
+    encodeDuplexReadRecords(cb, i * blockSize, blockSize, 1);
+    bytes += cb->pos;
+  }
+  return bytes / secondsSince(start);
+}
+
+// Answers to full-duplex read records returning data, its MSBs clocked in at
+// dataBit of every record. Idle bits read as 1.
+void fakeDuplexAnswers(uint8_t *answers,
+                       const uint8_t *data,
+                       int nBytes,
+                       int dataBit) {
+  memset(answers, 0xFF, (nBytes + 1) * duplexReadRecordSize);
+  for (int i = 0; i < nBytes; i++) {
+    for (int bit = 0; bit < 8; bit++) {
+      const int pos = i * duplexReadRecordSize * 8 + dataBit + bit;
+      if (!((data[i] >> (7 - bit)) & 1)) {
+        answers[pos / 8] &= ~(0x80 >> (pos % 8));
+      }
+    }
+  }
+}
+
+double benchDuplexPick(uint8_t *dst, const uint8_t *answers) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    pickDuplexReadData(dst, answers, blockSize, 24 + i % 2, 1);
+  }
+  return (double)iterations * blockSize / secondsSince(start);
+}
+
+double benchReverse(uint8_t *buffer) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    for (int j = 0; j < blockSize; j++) {
+      buffer[j] = reverseByte(buffer[j]);
+    }
+  }
+  return (double)iterations * blockSize / secondsSince(start);
+}
+
+// Coalesces the program stream of a block, as the write pipeline does per
+// segment. Throughput is over the plain stream bytes.
+double benchCoalesce(CommandBuffer *cb,
+                     const ProgramTemplate *t,
+                     const uint8_t *src) {
+  double seconds = 0;
+  int64_t bytes = 0;
+  for (int i = 0; i < iterations; i++) {
+    cb->pos = 0;
+    encodeProgramRecords(cb, t, i * blockSize, src, blockSize, 0);
+    bytes += cb->pos;
+
+    auto start = std::chrono::steady_clock::now();
+    coalesceClockOut(cb, 0);
+    seconds += secondsSince(start);
+  }
+  return bytes / seconds;
+}
+
+// Appends the bytes the clock data bytes out commands of cb shift, or
+// returns -1 if it holds anything else
+int clockedOutBytes(const CommandBuffer *cb, uint8_t *dst) {
+  int n = 0;
+  for (int pos = 0; pos < cb->pos;) {
+    if (cb->data[pos] != 0x11 || pos + 3 > cb->pos) {
+      return -1;
+    }
+    const int length = (cb->data[pos + 1] | (cb->data[pos + 2] << 8)) + 1;
+    memcpy(dst + n, cb->data + pos + 3, length);
+    n += length;
+    pos += 3 + length;
+  }
+  return n;
+}
+
+// Same as the write pipeline verify stage, a readback block against the image
+double benchCompare(const uint8_t *a, const uint8_t *b) {
+  // Called through a volatile pointer so the loop isn't folded away
+  int (*volatile compare)(const void *, const void *, size_t) = memcmp;
+
+  auto start = std::chrono::steady_clock::now();
+  int differs = 0;
+  for (int i = 0; i < iterations * 16; i++) {
+    differs += compare(a, b, blockSize) != 0;
+  }
+  if (differs) {
+    fprintf(stderr, "Compare buffers differ\n");
+  }
+  return (double)iterations * 16 * blockSize / secondsSince(start);
+}
+
+void report(const char *name, const char *unit, double bytesPerSecond) {
+  printf("{\"benchmark\": \"%s\", \"unit\": \"%s\", \"mb_per_s\": %.1f}\n",
+         name,
+         unit,
+         bytesPerSecond / 1e6);
+}
+
+int main() {
+  uint8_t *src = new uint8_t[blockSize];
+  srand(1);
+  for (int i = 0; i < blockSize; i++) {
+    src[i] = rand() & 0xFF;
+  }
+
+  ProgramTemplate t;
+  makeProgramTemplate(&t, 0xAAA, 0x555, 0xA0, 0);
+
+  CommandBuffer a = {nullptr, 0, programRecordsSize(&t, blockSize, 1)};
+  CommandBuffer b = a;
+  a.data = new uint8_t[a.capacity];
+  b.data = new uint8_t[b.capacity];
+
+  // Both encoders must produce the same bytes
+  encodeProgramRecords(&a, &t, 0x1F0000, src, blockSize, 1);
+  encodeProgramRecordsScalar(&b, &t, 0x1F0000, src, blockSize, 1);
+  if (a.pos != b.pos || memcmp(a.data, b.data, a.pos) != 0) {
+    fprintf(stderr, "Program encoders differ\n");
+    return 1;
+  }
+
+  // Coalescing must shift out the same bytes with fewer headers
+  memcpy(b.data, a.data, a.pos);
+  coalesceClockOut(&b, 0);
+  uint8_t *plainBits = new uint8_t[a.pos];
+  uint8_t *coalescedBits = new uint8_t[a.pos];
+  const int plainBytes = clockedOutBytes(&a, plainBits);
+  const int coalescedBytes = clockedOutBytes(&b, coalescedBits);
+  if (plainBytes < 0 || plainBytes != coalescedBytes ||
+      memcmp(plainBits, coalescedBits, plainBytes) != 0 || b.pos >= a.pos) {
+    fprintf(stderr, "Coalesced program stream differs\n");
+    return 1;
+  }
+  delete[] plainBits;
+  delete[] coalescedBits;
+
+  a.pos = b.pos = 0;
+  encodeReadRecords(&a, 0x1F0000, blockSize, 1);
+  encodeReadRecordsScalar(&b, 0x1F0000, blockSize, 1);
+  if (a.pos != b.pos || memcmp(a.data, b.data, a.pos) != 0) {
+    fprintf(stderr, "Read encoders differ\n");
+    return 1;
+  }
+
+  // Full-duplex answers must give the data back wherever it lands
+  uint8_t *answers = new uint8_t[(blockSize + 1) * duplexReadRecordSize];
+  for (int dataBit = 16; dataBit <= 32; dataBit++) {
+    fakeDuplexAnswers(answers, src, blockSize, dataBit);
+    pickDuplexReadData(b.data, answers, blockSize, dataBit, 0);
+    if (memcmp(b.data, src, blockSize) != 0) {
+      fprintf(stderr, "Duplex read data differs at bit %d\n", dataBit);
+      return 1;
+    }
+
+    // LSB first answers hold the same bits reversed in every byte, and give
+    // the data reversed
+    for (int i = 0; i < (blockSize + 1) * duplexReadRecordSize; i++) {
+      answers[i] = reverseByte(answers[i]);
+    }
+    pickDuplexReadData(b.data, answers, blockSize, dataBit, 1);
+    for (int i = 0; i < blockSize; i++) {
+      if (b.data[i] != reverseByte(src[i])) {
+        fprintf(stderr, "LSB first duplex data differs at bit %d\n", dataBit);
+        return 1;
+      }
+    }
+  }
+
+  report("program_simd",
+         "command_bytes",
+         benchProgram(encodeProgramRecords, &a, &t, src));
+  report("program_scalar",
+         "command_bytes",
+         benchProgram(encodeProgramRecordsScalar, &a, &t, src));
+  report("coalesce", "command_bytes", benchCoalesce(&a, &t, src));
+  report("read_simd", "command_bytes", benchRead(encodeReadRecords, &a));
+  report(
+    "read_scalar", "command_bytes", benchRead(encodeReadRecordsScalar, &a));
+  report("read_duplex", "command_bytes", benchDuplexRead(&a));
+
+  report("duplex_pick", "rom_bytes", benchDuplexPick(b.data, answers));
+  delete[] answers;
+
+  memcpy(b.data, src, blockSize);
+  report("reverse_byte", "rom_bytes", benchReverse(b.data));
+  memcpy(b.data, src, blockSize);
+  report("verify_compare", "rom_bytes", benchCompare(src, b.data));
+
+  delete[] a.data;
+  delete[] b.data;
+  delete[] src;
+  return 0;
+}
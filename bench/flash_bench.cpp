@@ -0,0 +1,254 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// End to end readRom()/writeRom() runs against the emulator. Prints one JSON
+// object per run with effective throughput over emulated time, bytes on the
+// wire per ROM byte, USB transfers and host wall time.
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "emulator.hpp"
+#include "hm05.hpp"
+
+// The emulator doesn't need the host to wait, only count the sleeps
+int64_t sleptMs = 0;
+
+void sleepMs(unsigned int ms) {
+  sleptMs += ms;
+}
+
+int64_t monotonicUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+           std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+}
+
+void logMessage(int logLevel, const char *formatString, ...) {
+  if (logLevel != LOG_ERROR) {
+    return;
+  }
+  va_list args;
+  va_start(args, formatString);
+  vfprintf(stderr, formatString, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+}
+
+LogContext getLogContext() {
+  return {nullptr, -1};
+}
+
+void setLogContext(LogContext) {
+}
+
+const char *emulatorDevice = "emu:realtime=0";
+const int imageSize = 2 * 1024 * 1024;
+
+struct Image {
+  uint8_t *data;
+  int size;
+};
+
+const uint8_t *readImage(void *user, int offset, int, uint8_t *) {
+  return ((const Image *)user)->data + offset;
+}
+
+// Checks read data against what the cart should hold
+struct CompareSink {
+  const Image *expected;
+  int offset;
+  int mismatches;
+};
+
+int compareBlock(void *user, const uint8_t *data, int nBytes) {
+  auto cs = (CompareSink *)user;
+  for (int i = 0; i < nBytes; i++) {
+    if (cs->offset + i >= cs->expected->size ||
+        data[i] != cs->expected->data[cs->offset + i]) {
+      cs->mismatches++;
+    }
+  }
+  cs->offset += nBytes;
+  return 0;
+}
+
+void report(const char *name,
+            int romBytes,
+            const EmulatorStats *before,
+            const EmulatorStats *after,
+            int64_t wallUs,
+            int64_t sleepMs) {
+  const double emulatedUs = after->elapsedUs - before->elapsedUs;
+  const int64_t cmdBytes = after->cmdBytes - before->cmdBytes;
+
+  printf("{\"benchmark\": \"%s\", \"rom_bytes\": %d, "
+         "\"effective_kbps\": %.1f, \"wire_bytes_per_rom_byte\": %.2f, "
+         "\"usb_writes\": %lld, \"usb_reads\": %lld, "
+         "\"emulated_ms\": %.1f, \"host_sleep_ms\": %lld, "
+         "\"wall_ms\": %.1f}\n",
+         name,
+         romBytes,
+         emulatedUs > 0 ? romBytes / 1024.0 / (emulatedUs / 1e6) : 0.0,
+         (double)cmdBytes / romBytes,
+         (long long)(after->usbWrites - before->usbWrites),
+         (long long)(after->usbReads - before->usbReads),
+         emulatedUs / 1000,
+         (long long)sleepMs,
+         wallUs / 1000.0);
+  fflush(stdout);
+}
+
+// Runs write (image != null) or read once and reports it. Reads must return
+// exactly the expected image.
+int run(CartCommContext *ccc,
+        const char *name,
+        const Image *image,
+        const WriteRomOptions *options,
+        const ReadRomOptions *readOptions = nullptr,
+        const Image *expected = nullptr) {
+  EmulatorStats before, after;
+  emulatorStats(&ccc->usb, &before);
+  const int64_t sleptBefore = sleptMs;
+  const int64_t start = monotonicUs();
+
+  int ret;
+  if (image) {
+    const RomSource source = {readImage, (void *)image, image->size};
+    ret = writeRom(ccc, &source, options);
+  } else {
+    CompareSink cs = {expected, 0, 0};
+    const RomSink sink = {compareBlock, &cs};
+    ret = readRom(ccc, &sink, readOptions);
+    if (ret >= 0 && (ret != expected->size || cs.mismatches)) {
+      fprintf(stderr,
+              "%s returned %d bytes, %d of them wrong, expected %d\n",
+              name,
+              ret,
+              cs.mismatches,
+              expected->size);
+      return -1;
+    }
+  }
+  if (ret < 0) {
+    fprintf(stderr, "%s failed\n", name);
+    return -1;
+  }
+
+  emulatorStats(&ccc->usb, &after);
+  report(name,
+         ret,
+         &before,
+         &after,
+         monotonicUs() - start,
+         sleptMs - sleptBefore);
+  return 0;
+}
+
+int main() {
+  Image random = {new uint8_t[imageSize], imageSize};
+  Image sparse = {new uint8_t[imageSize], imageSize};
+  Image small = {new uint8_t[imageSize], imageSize};
+
+  // Sparse: every other 64 KiB block erased, like padded ROM images
+  srand(1);
+  for (int i = 0; i < imageSize; i++) {
+    random.data[i] = rand() & 0xFF;
+    sparse.data[i] = (i / (64 * 1024)) % 2 ? erasedByte : random.data[i];
+    small.data[i] = i < imageSize / 4 ? random.data[i] : erasedByte;
+  }
+
+  CartCommContext *ccc = new CartCommContext();
+  if (openDeviceAndSetupMPSSE(ccc, emulatorDevice) < 0) {
+    return 1;
+  }
+
+  WriteRomOptions plain = {};
+  WriteRomOptions differential = {};
+  differential.differential = 1;
+
+  // A 2 KiB save area in the middle of the last sector
+  Image save = {random.data, 2 * 1024};
+  WriteRomOptions patch = {};
+  patch.offset = imageSize - 64 * 1024 + 0x400;
+
+  // Tracks the sparse write so writing it again skips every block
+  CartManifest *manifest = new CartManifest();
+  WriteRomOptions tracked = {};
+  tracked.manifest = manifest;
+
+  // The cart after the patch, and the small image without its erased tail
+  Image patched = {new uint8_t[imageSize], imageSize};
+  memcpy(patched.data, sparse.data, imageSize);
+  memcpy(patched.data + patch.offset, save.data, save.size);
+  Image smallHead = small;
+  while (smallHead.size > 0 && small.data[smallHead.size - 1] == erasedByte) {
+    smallHead.size--;
+  }
+
+  ReadRomOptions whole = {};
+  ReadRomOptions autoSize = {};
+  autoSize.autoSize = 1;
+
+  int ret = 0;
+  if (run(ccc, "write_random", &random, &plain) < 0 ||
+      run(ccc, "write_diff_unchanged", &random, &differential) < 0 ||
+      sampleCart(ccc, manifest) < 0 ||
+      run(ccc, "write_sparse", &sparse, &tracked) < 0 ||
+      run(ccc, "write_manifest_unchanged", &sparse, &tracked) < 0 ||
+      run(ccc, "write_patch_2k", &save, &patch) < 0 ||
+      run(ccc, "read", nullptr, nullptr, &whole, &patched) < 0 ||
+      run(ccc, "write_small", &small, &plain) < 0 ||
+      run(ccc, "read_auto_size", nullptr, nullptr, &autoSize, &smallHead) < 0) {
+    ret = 1;
+  }
+
+  closeDevice(ccc);
+  delete ccc;
+
+  // The same random image on chips with faster program sequences
+  const char *fastProgramDevices[][2] = {
+    {"write_random_bypass", "emu:realtime=0,chip=s29al016"},
+    {"write_random_buffer", "emu:realtime=0,chip=amd-buffer"},
+  };
+  for (const auto &device : fastProgramDevices) {
+    ccc = new CartCommContext();
+    if (openDeviceAndSetupMPSSE(ccc, device[1]) < 0) {
+      ret = 1;
+    } else {
+      if (run(ccc, device[0], &random, &plain) < 0) {
+        ret = 1;
+      }
+      closeDevice(ccc);
+    }
+    delete ccc;
+  }
+
+  delete manifest;
+  delete[] random.data;
+  delete[] sparse.data;
+  delete[] small.data;
+  delete[] patched.data;
+  return ret;
+}
@@ -21,10 +21,12 @@ SOFTWARE.
 */
 
 #include "hm05.hpp"
+#include "checksum.hpp"
+#include "trace.hpp"
 #include <cstring>
-
-#define CHIP_VENDOR  0x0403
-#define CHIP_PRODUCT 0x6010
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 //  Device Pins Setup
 //  -------------
@@ -44,15 +46,33 @@ SOFTWARE.
 #define UNSET_BITS(DST, BITS) ((DST) & (~(BITS)))
 
 const uint8_t ADBUSDirections = 0x1B;
-const int latencyMs = 2;
-
-enum SST39VF168XCommand {
-  SST_CHIP_ID,
-  SST_CFI_QUERY_MODE,
-  SST_EXIT_TO_READ_MODE,
-  SST_WRITE_BYTE,
-  SST_BLOCK_ERASE,
-  SST_END,
+const int usbChunkSize = 65536;
+
+// TCK/SK period = 12MHz  /  (( 1 +[ (0xValueH * 256) OR 0xValueL] ) * 2)
+const int clockDivisor = 0x0001;
+const int spiClockHz = 12000000 / ((1 + clockDivisor) * 2);
+
+// Clocks shifted per address/data record
+const int recordClocks = 32;
+
+// Status bits while an erase or program is in progress
+const uint8_t DQ7 = 0x80; // Data# polling: complement of the data bit
+const uint8_t DQ6 = 0x40; // Toggle bit: changes on every read
+// Status reads per USB round trip
+const int statusPollReads = 8;
+
+// Command bytes come from the chip's FlashDriver
+enum FlashCommand {
+  CMD_CHIP_ID,
+  CMD_CFI_QUERY_MODE,
+  CMD_EXIT_TO_READ_MODE,
+  CMD_WRITE_BYTE,
+  CMD_BLOCK_ERASE,
+  CMD_SECTOR_ERASE,
+  CMD_CHIP_ERASE,
+  CMD_UNLOCK_BYPASS,
+  CMD_UNLOCK_BYPASS_RESET,
+  CMD_END,
 };
 
 #define assertInBufferEmpty()                                                  \
@@ -68,147 +88,234 @@ enum SST39VF168XCommand {
     }                                                                          \
   }
 
-#define CALL_FTDI(CMD, ERROR, ...)                                             \
-  {                                                                            \
-    int ret;                                                                   \
-    if ((ret = CMD(ftdi, ##__VA_ARGS__)) < 0) {                                \
-      logMessage(                                                              \
-        LOG_ERROR, "%s: %d (%s)", ERROR, ret, ftdi_get_error_string(ftdi));    \
-      ftdi_usb_close(ftdi);                                                    \
-      ftdi_free(ftdi);                                                         \
-      return -1;                                                               \
-    }                                                                          \
-  }
-
 int setLowDataBits(CartCommContext *ccc, uint8_t bits);
 
-// 64-bits systems only
-inline uint8_t reverseByte(uint8_t b) {
-  return (b * 0x0202020202ULL & 0x010884422010ULL) % 1023;
+// sleepMs() accounted in the metrics and the trace
+inline void cartSleepMs(CartCommContext *ccc, unsigned int ms) {
+  const int64_t traceStart = traceBegin();
+  const int64_t start = monotonicUs();
+  sleepMs(ms);
+  metricsAdd(&ccc->metrics, METRIC_SLEEP_US, monotonicUs() - start);
+  traceEnd("sleep", traceStart, -1);
 }
 
 inline void setCS(CartCommContext *ccc, uint8_t high) {
+  const int64_t traceStart = traceBegin();
   if (high) {
     setLowDataBits(ccc, SET_BITS(ccc->lowDataBits, CS_BIT));
   } else {
     setLowDataBits(ccc, UNSET_BITS(ccc->lowDataBits, CS_BIT));
   }
-  sleepMs(1);
+  cartSleepMs(ccc, 1);
+  traceEnd("setCS", traceStart, -1);
+}
+
+inline void enqueueByteOut(CommandBuffer *cb, uint8_t byte) {
+  assert(cb->pos < cb->capacity);
+  cb->data[cb->pos++] = byte;
 }
 
 inline void enqueueByteOut(CartCommContext *ccc, uint8_t byte) {
-  assert(ccc->outBufferPos < OUT_BUFFER_SIZE);
-  ccc->outBuffer[ccc->outBufferPos++] = byte;
+  enqueueByteOut(&ccc->out, byte);
 }
 
-inline int flushOut(CartCommContext *ccc) {
-  assert(ccc->outBufferPos > 0);
-  auto ftdi = ccc->ftdi;
-  CALL_FTDI(ftdi_write_data,
-            "Unable to write data to device",
-            ccc->outBuffer,
-            ccc->outBufferPos);
-  sleepMs(latencyMs + 1);
-  ccc->outBufferPos = 0;
+// Sends the buffer and waits for the transfers to complete, so it can be
+// reused right away
+inline int flushCommandBuffer(CartCommContext *ccc, CommandBuffer *cb) {
+  assert(cb->pos > 0);
+  const int64_t traceStart = traceBegin();
+  const int64_t start = monotonicUs();
+  if (transportWrite(&ccc->usb, cb->data, cb->pos) < 0 ||
+      transportWaitWrites(&ccc->usb) < 0) {
+    return -1;
+  }
+
+  Metrics *m = &ccc->metrics;
+  metricsAdd(m, METRIC_BYTES_ENQUEUED, cb->pos);
+  metricsAdd(m, METRIC_BYTES_FLUSHED, cb->pos);
+  metricsAdd(m, METRIC_USB_WRITES, 1);
+  metricsObserve(m, HISTOGRAM_FLUSH_US, monotonicUs() - start);
+  traceEnd("flushOut", traceStart, cb->pos);
+  cb->pos = 0;
   return 0;
 }
 
+inline int flushOut(CartCommContext *ccc) {
+  return flushCommandBuffer(ccc, &ccc->out);
+}
+
 inline int flushIn(CartCommContext *ccc) {
-  const int flushBlockSize = 1024;
-  auto ftdi = ccc->ftdi;
-  uint8_t bytesRead = 0;
+  return transportDrain(&ccc->usb);
+}
 
-  uint8_t buff[flushBlockSize];
+// transportRead() accounted in the metrics and the trace
+inline int readAnswers(CartCommContext *ccc, uint8_t *dst, int nBytes) {
+  const int64_t traceStart = traceBegin();
+  const int64_t start = monotonicUs();
+  const int ret = transportRead(&ccc->usb, dst, nBytes);
+  const int64_t elapsed = monotonicUs() - start;
+
+  Metrics *m = &ccc->metrics;
+  metricsAdd(m, METRIC_USB_READS, 1);
+  metricsAdd(m, METRIC_USB_READ_BYTES, nBytes);
+  metricsAdd(m, METRIC_READ_WAIT_US, elapsed);
+  metricsObserve(m, HISTOGRAM_USB_READ_US, elapsed);
+  traceEnd("readSync", traceStart, nBytes);
+  return ret;
+}
 
-  for (;;) {
-    int ret = ftdi_read_data(ftdi, buff, flushBlockSize);
-    if (ret < 0) {
-      logMessage(LOG_ERROR,
-                 "%s: %d (%s)",
-                 "Unable to read data",
-                 ret,
-                 ftdi_get_error_string(ftdi));
-      ftdi_usb_close(ftdi);
-      ftdi_free(ftdi);
-      return -1;
-    }
-    if (ret == 0) {
-      break;
-    }
-    bytesRead += ret;
+#define readSync(DST, NBYTES)                                                  \
+  if (readAnswers(ccc, (DST), (NBYTES)) < 0) {                                 \
+    return -1;                                                                 \
   }
 
-  return bytesRead;
+// Cart data lines are bit reversed relative to the flash. With lsbFirst the
+// MPSSE clocks the data phase in LSB first, which undoes that in hardware.
+void enqueueReadRecord(CommandBuffer *cb, int addr, uint8_t lsbFirst) {
+  // Clock Data Bytes Out on -ve clock edge MSB first  (no read)
+  enqueueByteOut(cb, 0x11); // Command
+  enqueueByteOut(cb, 0x02); // (NBytes - 1) L
+  enqueueByteOut(cb, 0x00); // (NBytes - 1) H
+
+  // Load 3 bytes address
+  enqueueByteOut(cb, (addr >> 16) & 0x1F);
+  enqueueByteOut(cb, (addr >> 8) & 0xFF);
+  enqueueByteOut(cb, addr & 0xFF);
+
+  // Clock Data Bytes In on -ve clock edge MSB/LSB first (no write)
+  enqueueByteOut(cb, lsbFirst ? 0x2C : 0x24); // Command
+  enqueueByteOut(cb, 0x00);                   // (NBytes - 1) L
+  enqueueByteOut(cb, 0x00);                   // (NBytes - 1) H
 }
 
-#define readSync(DST, NBYTES)                                                  \
-  if (readSync_(ftdi, (DST), (NBYTES)) < 0) {                                  \
-    return -1;                                                                 \
+// Reads the answers to the full-duplex read records of nBytes at addr, see
+// encodeDuplexReadRecords()
+int readDuplexAnswers(CartCommContext *ccc,
+                      int addr,
+                      uint8_t *answers,
+                      int nBytes) {
+  encodeDuplexReadRecords(&ccc->out, addr, nBytes, 0);
+
+  // Force receive current readbuffer contents from chip
+  enqueueByteOut(ccc, 0x87);
+  flushOut(ccc);
+
+  readSync(answers, (nBytes + 1) * duplexReadRecordSize);
+  return 0;
+}
+
+// Called after each read request with the total bytes read so far
+typedef void (*ReadProgressCallback)(void *user, int bytesRead);
+
+// readFlash() through full-duplex read records. Keeps two requests in flight,
+// each one taking half the chip buffer with its answers, so the chip clocks
+// the next one while the answers to the previous one travel to the host.
+int readFlashDuplex(CartCommContext *ccc,
+                    int addr,
+                    uint8_t *dst,
+                    int nBytes,
+                    uint8_t reverseBytes,
+                    ReadProgressCallback onProgress,
+                    void *user) {
+  const int requestSize =
+    ccc->readBatchSize / 2 / duplexReadRecordSize - 1;
+  const int numRequests = (nBytes + requestSize - 1) / requestSize;
+  const uint8_t lsbFirst = reverseBytes && ccc->lsbFirstReads;
+
+  // The out buffer is empty between commands, each request takes half of it
+  CommandBuffer requests[2];
+  int64_t transfers[2] = {0, 0}; // Writes to complete before reusing them
+  for (int i = 0; i < 2; i++) {
+    requests[i].data = ccc->outBuffer + i * (OUT_BUFFER_SIZE / 2);
+    requests[i].pos = 0;
+    requests[i].capacity = OUT_BUFFER_SIZE / 2;
   }
 
-// Keeps reading until the desired amount of bytes was actually read.
-int readSync_(struct ftdi_context *ftdi, uint8_t *dst, int nBytes) {
-  uint8_t *curDst = dst;
-  int missingBytes = nBytes;
+  for (int i = 0; i <= numRequests; i++) {
+    // Submit request i while the answers to request i - 1 come in
+    if (i < numRequests) {
+      const int offset = i * requestSize;
+      const int bytesToRead =
+        nBytes - offset > requestSize ? requestSize : nBytes - offset;
+      CommandBuffer *cb = &requests[i % 2];
 
-  for (;;) {
-    int ret = ftdi_read_data(ftdi, curDst, missingBytes);
-    if (ret < 0) {
-      logMessage(LOG_ERROR,
-                 "%s: %d (%s)",
-                 "Unable to read data",
-                 ret,
-                 ftdi_get_error_string(ftdi));
-      ftdi_usb_close(ftdi);
-      ftdi_free(ftdi);
-      return -1;
+      if (transportWaitWritesUntil(&ccc->usb, transfers[i % 2]) < 0) {
+        return -1;
+      }
+      cb->pos = 0;
+      encodeDuplexReadRecords(cb, addr + offset, bytesToRead, lsbFirst);
+      // Force receive current readbuffer contents from chip
+      enqueueByteOut(cb, 0x87);
+
+      const int64_t traceStart = traceBegin();
+      if (transportWrite(&ccc->usb, cb->data, cb->pos) < 0) {
+        return -1;
+      }
+      traceEnd("submitWrite", traceStart, cb->pos);
+      transfers[i % 2] = ccc->usb.submittedWrites;
+      metricsAdd(&ccc->metrics, METRIC_BYTES_ENQUEUED, cb->pos);
+      metricsAdd(&ccc->metrics, METRIC_BYTES_FLUSHED, cb->pos);
+      metricsAdd(&ccc->metrics, METRIC_USB_WRITES, 1);
     }
-    missingBytes -= ret;
-    curDst += ret;
-    if (missingBytes == 0) {
-      break;
+
+    if (i > 0) {
+      const int offset = (i - 1) * requestSize;
+      const int bytesToRead =
+        nBytes - offset > requestSize ? requestSize : nBytes - offset;
+
+      readSync(ccc->inBuffer, (bytesToRead + 1) * duplexReadRecordSize);
+      pickDuplexReadData(dst + offset,
+                         ccc->inBuffer,
+                         bytesToRead,
+                         ccc->duplexDataBit,
+                         lsbFirst);
+
+      // Reverse bytes
+      if (reverseBytes && !lsbFirst) {
+        for (int j = offset; j < offset + bytesToRead; j++) {
+          dst[j] = reverseByte(dst[j]);
+        }
+      }
+
+      if (onProgress) {
+        onProgress(user, offset + bytesToRead);
+      }
     }
   }
-  return nBytes;
+
+  return transportWaitWrites(&ccc->usb);
 }
 
 int readFlash(CartCommContext *ccc,
               int addr,
               uint8_t *dst,
               int nBytes,
-              uint8_t reverseBytes = 0) {
+              uint8_t reverseBytes = 0,
+              ReadProgressCallback onProgress = nullptr,
+              void *user = nullptr) {
   setCS(ccc, 0);
-  sleepMs(1);
+  cartSleepMs(ccc, 1);
 
-  auto ftdi = ccc->ftdi;
+  if (ccc->duplexDataBit) {
+    return readFlashDuplex(
+      ccc, addr, dst, nBytes, reverseBytes, onProgress, user);
+  }
 
   // It seems that until I read from the device, the buffer keeps filling
   // and when it's full, the write fails.
-  // The buffer is quite small so read requests need to be splitted
+  // Read requests are splitted so the answers fit the chip's buffer, see
+  // setupReadBatch()
 
-  const int readRequestSize = 256;
+  const int readRequestSize = ccc->readBatchSize;
+  const uint8_t lsbFirst = reverseBytes && ccc->lsbFirstReads;
+  int bytesRead = 0;
 
   while (nBytes > 0) {
     const int bytesToRead = nBytes > readRequestSize ? readRequestSize : nBytes;
     nBytes -= bytesToRead;
 
-    for (int i = 0; i < bytesToRead; i++) {
-      // Clock Data Bytes Out on -ve clock edge MSB first  (no read)
-      enqueueByteOut(ccc, 0x11); // Command
-      enqueueByteOut(ccc, 0x02); // (NBytes - 1) L
-      enqueueByteOut(ccc, 0x00); // (NBytes - 1) H
-
-      // Load 3 bytes address
-      enqueueByteOut(ccc, (addr >> 16) & 0x1F);
-      enqueueByteOut(ccc, (addr >> 8) & 0xFF);
-      enqueueByteOut(ccc, addr & 0xFF);
-
-      // Clock Data Bytes In on -ve clock edge MSB first (no write)
-      enqueueByteOut(ccc, 0x24); // Command
-      enqueueByteOut(ccc, 0x00); // (NBytes - 1) L
-      enqueueByteOut(ccc, 0x00); // (NBytes - 1) H
-      addr++;
-    }
+    encodeReadRecords(&ccc->out, addr, bytesToRead, lsbFirst);
+    addr += bytesToRead;
 
     // Force receive current readbuffer contents from chip
     enqueueByteOut(ccc, 0x87);
@@ -217,13 +324,18 @@ int readFlash(CartCommContext *ccc,
     readSync(dst, bytesToRead);
 
     // Reverse bytes
-    if (reverseBytes) {
+    if (reverseBytes && !lsbFirst) {
       for (int i = 0; i < bytesToRead; i++) {
         dst[i] = reverseByte(dst[i]);
       }
     }
 
     dst += bytesToRead;
+    bytesRead += bytesToRead;
+
+    if (onProgress) {
+      onProgress(user, bytesRead);
+    }
   }
   return 0;
 }
@@ -236,11 +348,11 @@ int setLowDataBits(CartCommContext *ccc, uint8_t bits) {
   return flushOut(ccc);
 }
 
-void enqueueFlashOut(CartCommContext *ccc, int addr, uint8_t data) {
+void enqueueFlashOut(CommandBuffer *cb, int addr, uint8_t data) {
   // Clock Data Bytes Out on -ve clock edge MSB first  (no read)
-  enqueueByteOut(ccc, 0x11); // Command
-  enqueueByteOut(ccc, 0x03); // (NBytes - 1) L
-  enqueueByteOut(ccc, 0x00); // (NBytes - 1) H
+  enqueueByteOut(cb, 0x11); // Command
+  enqueueByteOut(cb, 0x03); // (NBytes - 1) L
+  enqueueByteOut(cb, 0x00); // (NBytes - 1) H
 
   // Layout:
   //    2 1111 1111 1100 000000000   0000 0000
@@ -248,60 +360,152 @@ void enqueueFlashOut(CartCommContext *ccc, int addr, uint8_t data) {
   // CxxA AAAA AAAA AAAA AAAA AAAA | DDDD DDDD
 
   // Address (21 bits) and data
-  enqueueByteOut(ccc, ((addr >> 16) & 0x1F) | 0x80); // Write flag (0x80)
-  enqueueByteOut(ccc, (addr >> 8) & 0xFF);
-  enqueueByteOut(ccc, addr & 0xFF);
-  enqueueByteOut(ccc, data);
+  enqueueByteOut(cb, ((addr >> 16) & 0x1F) | 0x80); // Write flag (0x80)
+  enqueueByteOut(cb, (addr >> 8) & 0xFF);
+  enqueueByteOut(cb, addr & 0xFF);
+  enqueueByteOut(cb, data);
 }
 
-void enqueueSST39VF168XCommand(CartCommContext *ccc,
-                               SST39VF168XCommand command,
-                               int param1 = 0,
-                               int param2 = 0) {
-  assert(command < SST_END);
+void enqueueFlashCommand(CommandBuffer *cb,
+                         const FlashDriver *driver,
+                         FlashCommand command,
+                         int param1 = 0,
+                         int param2 = 0) {
+  assert(command < CMD_END);
+  const int unlockAddr1 = driver->unlockAddr1;
+  const int unlockAddr2 = driver->unlockAddr2;
+
+  // The only command taking no unlock cycles
+  if (command == CMD_UNLOCK_BYPASS_RESET) {
+    enqueueFlashOut(cb, unlockAddr1, 0x90);
+    enqueueFlashOut(cb, unlockAddr1, 0x00);
+    return;
+  }
 
-  // All comands share this first two address/data combinations
-  enqueueFlashOut(ccc, 0xAAA, 0xAA);
-  enqueueFlashOut(ccc, 0x555, 0x55);
+  // All other comands share this first two address/data combinations
+  enqueueFlashOut(cb, unlockAddr1, 0xAA);
+  enqueueFlashOut(cb, unlockAddr2, 0x55);
 
   switch (command) {
-    case SST_CHIP_ID:
-      enqueueFlashOut(ccc, 0xAAA, 0x90);
+    case CMD_CHIP_ID:
+      enqueueFlashOut(cb, unlockAddr1, 0x90);
+      break;
+    case CMD_CFI_QUERY_MODE:
+      enqueueFlashOut(cb, unlockAddr1, 0x98);
       break;
-    case SST_CFI_QUERY_MODE:
-      enqueueFlashOut(ccc, 0xAAA, 0x98);
+    case CMD_EXIT_TO_READ_MODE:
+      enqueueFlashOut(cb, unlockAddr1, 0xF0);
       break;
-    case SST_EXIT_TO_READ_MODE:
-      enqueueFlashOut(ccc, 0xAAA, 0xF0);
+    case CMD_WRITE_BYTE:
+      enqueueFlashOut(cb, unlockAddr1, driver->programCommand);
+      enqueueFlashOut(cb, param1, reverseByte(param2));
       break;
-    case SST_WRITE_BYTE:
-      enqueueFlashOut(ccc, 0xAAA, 0xA0);
-      enqueueFlashOut(ccc, param1, reverseByte(param2));
+    case CMD_BLOCK_ERASE:
+    case CMD_SECTOR_ERASE:
+      enqueueFlashOut(cb, unlockAddr1, 0x80);
+      enqueueFlashOut(cb, unlockAddr1, 0xAA);
+      enqueueFlashOut(cb, unlockAddr2, 0x55);
+      enqueueFlashOut(cb,
+                      param1,
+                      command == CMD_BLOCK_ERASE ? driver->blockEraseCommand
+                                                 : driver->sectorEraseCommand);
       break;
-    case SST_BLOCK_ERASE:
-      enqueueFlashOut(ccc, 0xAAA, 0x80);
-      enqueueFlashOut(ccc, 0xAAA, 0xAA);
-      enqueueFlashOut(ccc, 0x555, 0x55);
-      enqueueFlashOut(ccc, param1, 0x30);
+    case CMD_CHIP_ERASE:
+      enqueueFlashOut(cb, unlockAddr1, 0x80);
+      enqueueFlashOut(cb, unlockAddr1, 0xAA);
+      enqueueFlashOut(cb, unlockAddr2, 0x55);
+      enqueueFlashOut(cb, unlockAddr1, driver->chipEraseCommand);
       break;
-    case SST_END:
+    case CMD_UNLOCK_BYPASS:
+      enqueueFlashOut(cb, unlockAddr1, 0x20);
+      break;
+    case CMD_UNLOCK_BYPASS_RESET:
+    case CMD_END:
       break;
   }
 }
 
-int writeSST39VF168XCommand(CartCommContext *ccc,
-                            SST39VF168XCommand command,
-                            int param1 = 0,
-                            int param2 = 0) {
-  enqueueSST39VF168XCommand(ccc, command, param1, param2);
+int writeFlashCommand(CartCommContext *ccc,
+                      FlashCommand command,
+                      int param1 = 0,
+                      int param2 = 0) {
+  enqueueFlashCommand(&ccc->out, ccc->driver, command, param1, param2);
+  coalesceClockOut(&ccc->out, 0);
 
-  flushOut(ccc);
+  if (flushOut(ccc) < 0) {
+    return -1;
+  }
   assertInBufferEmpty();
-  sleepMs(1);
 
   return 0;
 }
 
+// Polls addr until the erase or program running there completes: DQ6 stops
+// toggling and DQ7 shows the true data. expected is the raw byte being
+// programmed, or erasedByte for erases.
+// Returns the elapsed microseconds, -1 on errors and -2 on timeout.
+int64_t waitFlashReady(CartCommContext *ccc,
+                       int addr,
+                       uint8_t expected,
+                       int64_t timeoutUs) {
+  const int64_t start = monotonicUs();
+  uint8_t status[statusPollReads];
+
+  for (;;) {
+    for (int i = 0; i < statusPollReads; i++) {
+      enqueueReadRecord(&ccc->out, addr, 0);
+    }
+    enqueueByteOut(ccc, 0x87);
+    if (flushOut(ccc) < 0) {
+      return -1;
+    }
+
+    readSync(status, statusPollReads);
+    metricsAdd(&ccc->metrics, METRIC_STATUS_POLLS, 1);
+
+    const int64_t elapsed = monotonicUs() - start;
+    for (int i = 1; i < statusPollReads; i++) {
+      if (((status[i - 1] ^ status[i]) & DQ6) == 0 &&
+          (status[i] & DQ7) == (expected & DQ7)) {
+        return elapsed;
+      }
+    }
+
+    if (elapsed > timeoutUs) {
+      return -2;
+    }
+  }
+}
+
+// Idle records needed after a program so the next command is not sent while
+// the chip is still busy for busyUs at the current SPI clock
+int idleRecords(int busyUs) {
+  const int busyClocks = (int)((int64_t)busyUs * spiClockHz / 1000000);
+  if (busyClocks <= recordClocks) {
+    return 0;
+  }
+  return (busyClocks - 1) / recordClocks;
+}
+
+int programPaddingRecords(const CartCommContext *ccc) {
+  return idleRecords(ccc->driver->byteProgramUs ? ccc->driver->byteProgramUs
+                                                : ccc->programTimeoutUs);
+}
+
+// Last byte in the block that gets programmed, -1 if none
+int lastProgrammedByte(const uint8_t *src, int nBytes) {
+  for (int i = nBytes - 1; i >= 0; i--) {
+    if (src[i] != erasedByte) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int isErasedBlock(const uint8_t *src, int nBytes) {
+  return lastProgrammedByte(src, nBytes) < 0;
+}
+
 // TODO: Dump the rest of the fields
 void dumpCFIDataToLog(const CartCommContext *ccc) {
   auto cfiqs = &ccc->cfiqs;
@@ -330,10 +534,65 @@ void dumpCFIDataToLog(const CartCommContext *ccc) {
 
   logMessage(
     LOG_INFO, "Using block size: %d bytes", ccc->biggestBlockSizeBytes);
+  logMessage(
+    LOG_INFO, "Using sector size: %d bytes", ccc->smallestBlockSizeBytes);
+}
+
+// Full-duplex reads sample the data on the other clock edge, which may skew
+// it by a bit or more depending on the cart. Finds where the MSB of the Id
+// bytes lands in their records, closest to the aligned position first, and
+// falls back to half-duplex reads if nowhere gives them back.
+int findDuplexDataBit(CartCommContext *ccc) {
+  uint8_t answers[(sizeof(ccc->chipId) + 1) * duplexReadRecordSize];
+  uint8_t id[sizeof(ccc->chipId)];
+
+  if (readDuplexAnswers(ccc, 0x0, answers, sizeof(id)) < 0) {
+    return -1;
+  }
+
+  for (int i = 0; i <= 16; i++) {
+    const int dataBit = 24 + (i & 1 ? (i + 1) / 2 : -i / 2);
+    pickDuplexReadData(id, answers, sizeof(id), dataBit, 0);
+    if (memcmp(id, ccc->chipId, sizeof(id)) == 0) {
+      ccc->duplexDataBit = dataBit;
+      logMessage(LOG_INFO, "Full-duplex reads data bit: %d", dataBit);
+      return 0;
+    }
+  }
+
+  logMessage(LOG_INFO, "Full-duplex reads mismatch, using half-duplex reads");
+  return 0;
+}
+
+// The Id bytes only narrow the data bit down. Full-duplex reads are kept
+// once the first block read through them, with the data reversed as dumps
+// read it, matches the half-duplex read.
+int checkDuplexReads(CartCommContext *ccc) {
+  const int blockSize = ccc->biggestBlockSizeBytes;
+  const int dataBit = ccc->duplexDataBit;
+  uint8_t *duplex = new uint8_t[blockSize];
+  uint8_t *halfDuplex = new uint8_t[blockSize];
+
+  int ret = readFlash(ccc, 0x0, duplex, blockSize, 1);
+  ccc->duplexDataBit = 0;
+  if (ret == 0) {
+    ret = readFlash(ccc, 0x0, halfDuplex, blockSize, 1);
+  }
+  if (ret == 0 && memcmp(duplex, halfDuplex, blockSize) == 0) {
+    ccc->duplexDataBit = dataBit;
+  } else if (ret == 0) {
+    logMessage(LOG_INFO, "Full-duplex block mismatch, using half-duplex reads");
+  }
+
+  delete[] duplex;
+  delete[] halfDuplex;
+  return ret;
 }
 
 int readChipId(CartCommContext *ccc) {
-  if (writeSST39VF168XCommand(ccc, SST_CHIP_ID) < 0) {
+  // Half-duplex reads until findDuplexDataBit() checks the other ones
+  ccc->duplexDataBit = 0;
+  if (writeFlashCommand(ccc, CMD_CHIP_ID) < 0) {
     return -1;
   }
 
@@ -342,7 +601,29 @@ int readChipId(CartCommContext *ccc) {
     return -1;
   }
 
-  if (writeSST39VF168XCommand(ccc, SST_EXIT_TO_READ_MODE) < 0) {
+  // The Id bytes are not bit palindromes, so reading them again LSB first
+  // must give their software reversal. Otherwise keep reversing in software.
+  uint8_t lsbFirstId[3];
+  ccc->lsbFirstReads = 1;
+  if (readFlash(ccc, 0x0, lsbFirstId, 3, 1) < 0) {
+    logMessage(LOG_ERROR, "Chip Id read failed.");
+    return -1;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    if (lsbFirstId[i] != reverseByte(ccc->chipId[i])) {
+      logMessage(LOG_INFO, "LSB first reads mismatch, using software reversal");
+      ccc->lsbFirstReads = 0;
+      break;
+    }
+  }
+
+  if (findDuplexDataBit(ccc) < 0) {
+    logMessage(LOG_ERROR, "Chip Id read failed.");
+    return -1;
+  }
+
+  if (writeFlashCommand(ccc, CMD_EXIT_TO_READ_MODE) < 0) {
     return -1;
   }
 
@@ -352,7 +633,7 @@ int readChipId(CartCommContext *ccc) {
 int readCFIQueryStruct(CartCommContext *ccc) {
   auto cfiqs = &ccc->cfiqs;
 
-  if (writeSST39VF168XCommand(ccc, SST_CFI_QUERY_MODE) < 0) {
+  if (writeFlashCommand(ccc, CMD_CFI_QUERY_MODE) < 0) {
     return -1;
   }
 
@@ -370,7 +651,7 @@ int readCFIQueryStruct(CartCommContext *ccc) {
     return -1;
   }
 
-  if (writeSST39VF168XCommand(ccc, SST_EXIT_TO_READ_MODE) < 0) {
+  if (writeFlashCommand(ccc, CMD_EXIT_TO_READ_MODE) < 0) {
     return -1;
   }
 
@@ -382,15 +663,69 @@ int readCFIQueryStruct(CartCommContext *ccc) {
 
   assert(cfiqs->numberOfEraseBlockRegions > 0);
 
-  // Find largest block size and use it
+  // Typical times are 2^N us (program) or ms (erase), maximums are 2^N
+  // times the typical ones (See JESD68-01)
+  const uint8_t *timeouts = cfiqs->typicalTimeouts;
+  ccc->programTimeoutUs = (1 << timeouts[0]) << timeouts[4];
+  ccc->bufferTimeoutUs =
+    cfiqs->maximumBytesInMultibyteProgram && timeouts[1]
+      ? (1 << timeouts[1]) << timeouts[5]
+      : 0;
+  ccc->blockEraseTimeoutUs = (1000 << timeouts[2]) << timeouts[6];
+  ccc->chipEraseTimeoutUs =
+    timeouts[3] ? (1000 << timeouts[3]) << timeouts[7] : 0;
+
+  // Find largest block size and use it, the smallest one is the sector size
   ccc->biggestBlockSizeBytes = ccc->blockRegions[0].blockSize << 8;
-  for (int i = 1; i < cfiqs->numberOfEraseBlockRegions; i++) {
+  ccc->smallestBlockSizeBytes = ccc->biggestBlockSizeBytes;
+  int64_t regionBytes = 0;
+  for (int i = 0; i < cfiqs->numberOfEraseBlockRegions; i++) {
     uint32_t currentSize = ccc->blockRegions[i].blockSize << 8;
     if (currentSize > ccc->biggestBlockSizeBytes) {
       ccc->biggestBlockSizeBytes = currentSize;
     }
+    if (currentSize < ccc->smallestBlockSizeBytes) {
+      ccc->smallestBlockSizeBytes = currentSize;
+    }
+    regionBytes += (int64_t)currentSize * (ccc->blockRegions[i].nBlocks + 1);
   }
 
+  // Regions add up to the chip size when they split it in address ranges.
+  // The SST39VF168x lists its 4 KiB sectors and 64 KiB blocks instead, each
+  // covering the whole chip.
+  ccc->overlappingRegions = regionBytes != (int64_t)1 << cfiqs->deviceSize;
+
+  return 0;
+}
+
+// Picks the driver for the chip Id and CFI command set, and drops the
+// erase sizes and commands it lacks
+int selectFlashDriver(CartCommContext *ccc) {
+  ccc->driver = findFlashDriver(
+    ccc->chipId[0], ccc->chipId[1], ccc->cfiqs.controlInterfaceId);
+  if (!ccc->driver) {
+    logMessage(LOG_ERROR,
+               "Unsupported flash chip: manufacturer %X, device %X, CFI "
+               "command set %04X",
+               ccc->chipId[0],
+               ccc->chipId[1],
+               ccc->cfiqs.controlInterfaceId);
+    return -1;
+  }
+  logMessage(LOG_INFO, "Using flash driver: %s", ccc->driver->name);
+
+  if (!ccc->driver->chipEraseCommand) {
+    ccc->chipEraseTimeoutUs = 0;
+  }
+  if (!ccc->driver->writeBufferCommand) {
+    ccc->bufferTimeoutUs = 0;
+  }
+
+  // Overlapping regions list sectors that only a sector erase command
+  // reaches, erase whole blocks instead
+  if (ccc->overlappingRegions && !ccc->driver->sectorEraseCommand) {
+    ccc->smallestBlockSizeBytes = ccc->biggestBlockSizeBytes;
+  }
   return 0;
 }
 
@@ -398,7 +733,7 @@ int powerOn(CartCommContext *ccc) {
   if (!ccc->poweredOn) {
     setCS(ccc, 1);
     setLowDataBits(ccc, UNSET_BITS(ccc->lowDataBits, POWER_BIT));
-    sleepMs(100);
+    cartSleepMs(ccc, 100);
     setCS(ccc, 0);
     ccc->poweredOn = 1;
   }
@@ -408,155 +743,1203 @@ int powerOn(CartCommContext *ccc) {
 int powerOff(CartCommContext *ccc) {
   if (ccc->poweredOn) {
     setCS(ccc, 1);
-    sleepMs(1);
+    cartSleepMs(ccc, 1);
     setLowDataBits(ccc, SET_BITS(ccc->lowDataBits, POWER_BIT));
     ccc->poweredOn = 0;
   }
   return 0;
 }
 
-int writeRom(CartCommContext *ccc, int romSize) {
-  // NOTE: Refactor if bigger chip size is ever used
-  assert((1 << ccc->cfiqs.deviceSize) <= ROM_BUFFER_SIZE);
-  assert(romSize <= ROM_BUFFER_SIZE);
+// Erase planner
+//------------------------------
 
-  int blockNumber = 0;
+// One erase command of a write
+struct EraseUnit {
+  int addr;
+  int size;
+  FlashCommand command;
+};
+
+// Fills units with the erase commands covering [start, end), erasing as few
+// sectors as possible with as few commands as possible. Returns the number of
+// units, at most the number of sectors in the chip.
+int planErase(const CartCommContext *ccc,
+              int start,
+              int end,
+              EraseUnit *units) {
+  const int sectorSize = ccc->smallestBlockSizeBytes;
+  const int blockSize = ccc->biggestBlockSizeBytes;
+  int count = 0;
+
+  // Sectors everywhere, whole blocks where the range covers them
+  if (ccc->overlappingRegions) {
+    const int limit = (end + sectorSize - 1) / sectorSize * sectorSize;
+    for (int addr = start / sectorSize * sectorSize; addr < limit;) {
+      EraseUnit *unit = &units[count++];
+      unit->addr = addr;
+      if (addr % blockSize == 0 && addr + blockSize <= limit) {
+        unit->size = blockSize;
+        unit->command = CMD_BLOCK_ERASE;
+      } else {
+        unit->size = sectorSize;
+        unit->command = CMD_SECTOR_ERASE;
+      }
+      addr += unit->size;
+    }
+    return count;
+  }
+
+  // Every block of the regions the range goes through
   int addr = 0;
-  uint8_t *src = ccc->romBuffer;
-  int remainingBytes = romSize;
+  for (int i = 0; i < ccc->cfiqs.numberOfEraseBlockRegions; i++) {
+    const CFIBlockRegion *region = &ccc->blockRegions[i];
+    for (int j = 0; j <= region->nBlocks; j++) {
+      const int size = region->blockSize << 8;
+      if (addr < end && addr + size > start) {
+        units[count].addr = addr;
+        units[count].size = size;
+        units[count].command = CMD_BLOCK_ERASE;
+        count++;
+      }
+      addr += size;
+    }
+  }
+  return count;
+}
+
+// Presents the erased window to the encoder: the image with the cart bytes
+// that share its first and last sectors around it
+struct WindowSource {
+  const RomSource *image;
+  int imageOffset; // Window offset of the first image byte
+  const uint8_t *head; // imageOffset cart bytes before the image
+  const uint8_t *tail; // Cart bytes after the image to the end of the window
+};
+
+const uint8_t *readWindow(void *user,
+                          int offset,
+                          int nBytes,
+                          uint8_t *scratch) {
+  auto ws = (const WindowSource *)user;
+  const RomSource *image = ws->image;
+  const int imageEnd = ws->imageOffset + image->size;
+
+  if (offset >= ws->imageOffset && offset + nBytes <= imageEnd) {
+    return image->read(
+      image->user, offset - ws->imageOffset, nBytes, scratch);
+  }
+
+  for (int pos = 0; pos < nBytes;) {
+    const int at = offset + pos;
+    int n;
+    if (at < ws->imageOffset) {
+      n = ws->imageOffset - at < nBytes - pos ? ws->imageOffset - at
+                                              : nBytes - pos;
+      memcpy(scratch + pos, ws->head + at, n);
+    } else if (at < imageEnd) {
+      n = imageEnd - at < nBytes - pos ? imageEnd - at : nBytes - pos;
+      const uint8_t *src =
+        image->read(image->user, at - ws->imageOffset, n, scratch + pos);
+      if (!src) {
+        return nullptr;
+      }
+      if (src != scratch + pos) {
+        memcpy(scratch + pos, src, n);
+      }
+    } else {
+      n = nBytes - pos;
+      memcpy(scratch + pos, ws->tail + (at - imageEnd), n);
+    }
+    pos += n;
+  }
+  return scratch;
+}
 
-  uint8_t *readBackBuffer = new uint8_t[ccc->biggestBlockSizeBytes];
+// Write pipeline
+//------------------------------
+// writeRom() drives the USB link from the calling thread. An encoder thread
+// loads the data of every erase unit from the RomSource and streams their
+// program commands through a small ring of command segments, running ahead of
+// the unit being sent. A verify thread compares readback data while the rest
+// of the unit is still being read. Memory use depends on the erase block size
+// only, never on the image size.
+
+const int blockSlots = 2;
+const int commandSegments = 8;
+const int commandSegmentSize = 16 * 1024;
+
+struct BlockSlot {
+  uint8_t *scratch;   // Storage for sources that copy the data
+  const uint8_t *src; // Image data for the block
+  int addr;
+  int nBytes;
+  FlashCommand eraseCommand;
+  uint8_t erased;    // Entirely erasedByte, nothing to program
+  uint8_t unchanged; // The manifest says the cart already holds it
+  uint8_t failed;    // RomSource read failed
+  uint8_t ready;
+};
+
+struct CommandSegment {
+  CommandBuffer cmds;
+  int skippedBytes;
+  int64_t transfer; // Transport write carrying it, 0 if empty
+  uint8_t lastOfBlock;
+};
 
-  logMessage(LOG_INFO, "Writing %d bytes", romSize);
-  while (remainingBytes > 0) {
-    const int bytesToWrite = remainingBytes > (int)ccc->biggestBlockSizeBytes
-                               ? ccc->biggestBlockSizeBytes
-                               : remainingBytes;
-    remainingBytes -= bytesToWrite;
+// How the program commands are sent, the fastest way the chip supports
+enum ProgramMode {
+  PROGRAM_BYTE,   // Unlock cycles, program command and data for every byte
+  PROGRAM_BYPASS, // Unlock bypass mode, program command and data only
+  PROGRAM_BUFFER, // Write buffer pages
+};
+
+struct WritePipeline {
+  std::mutex mutex;
+  std::condition_variable cond;
+  uint8_t stop;
+
+  const RomSource *source; // The erased window, from windowStart
+  Metrics *metrics;
+  const CartManifest *manifest; // Cart contents before the write, or null
+  CartManifest *written;        // Cart contents after the write
+  const EraseUnit *units;       // Erase blocks or sectors of the window
+  int numBlocks;
+  int windowStart;
+  uint8_t chipErase; // Erase the whole chip first instead of every unit
+  ProgramMode programMode;
+  int paddingRecords;              // Byte programs only
+  ProgramTemplate programTemplate; // Byte programs only
+  BufferProgram buffer;            // Write buffer programs only
+  int bytesPerSegment;             // Image bytes encoded per segment
+  int programTimeoutUs;            // Max time of a byte or buffer program
+
+  // Encoder stage
+  BlockSlot blocks[blockSlots];
+  int blocksReleased; // Blocks the USB thread is done with
+  CommandSegment segments[commandSegments];
+  int64_t segmentsEncoded;
+  int64_t segmentsSent;
+  int64_t segmentsReleased; // Sent and no longer in flight
+
+  // Verify stage
+  const uint8_t *expected;
+  uint8_t *readBack;
+  int readBytes;    // Bytes of the current block already read back
+  int checkedBytes; // Bytes of the current block already compared
+  uint8_t mismatch;
+};
+
+// Streams the program commands of one block through the segment ring
+void encodeBlockSegments(WritePipeline *wp, const BlockSlot *bs) {
+  const int bytesPerSegment = wp->bytesPerSegment;
+
+  for (int offset = 0; offset < bs->nBytes; offset += bytesPerSegment) {
+    const int nBytes = bs->nBytes - offset > bytesPerSegment
+                         ? bytesPerSegment
+                         : bs->nBytes - offset;
+
+    {
+      std::unique_lock<std::mutex> lock(wp->mutex);
+      wp->cond.wait(lock, [&] {
+        return wp->stop ||
+               wp->segmentsEncoded - wp->segmentsReleased < commandSegments;
+      });
+      if (wp->stop) {
+        return;
+      }
+    }
+
+    const int64_t traceStart = traceBegin();
+    CommandSegment *seg =
+      &wp->segments[wp->segmentsEncoded % commandSegments];
+    seg->cmds.pos = 0;
+    if (wp->programMode == PROGRAM_BUFFER) {
+      seg->skippedBytes = encodeBufferProgramRecords(
+        &seg->cmds, &wp->buffer, bs->addr + offset, bs->src + offset, nBytes);
+    } else {
+      seg->skippedBytes = encodeProgramRecords(&seg->cmds,
+                                               &wp->programTemplate,
+                                               bs->addr + offset,
+                                               bs->src + offset,
+                                               nBytes,
+                                               wp->paddingRecords);
+    }
+    coalesceClockOut(&seg->cmds, 0);
+    seg->transfer = 0;
+    seg->lastOfBlock = offset + nBytes >= bs->nBytes;
+    metricsAdd(wp->metrics, METRIC_BYTES_ENQUEUED, seg->cmds.pos);
+    traceEnd("encode", traceStart, seg->cmds.pos);
+
+    {
+      std::lock_guard<std::mutex> lock(wp->mutex);
+      wp->segmentsEncoded++;
+    }
+    wp->cond.notify_all();
+  }
+}
+
+// Records the sectors and block samples of bs in the written manifest.
+// Returns 1 if the manifest says the cart already holds all of them.
+int hashBlock(WritePipeline *wp, const BlockSlot *bs) {
+  const CartManifest *manifest = wp->manifest;
+  CartManifest *written = wp->written;
+  int unchanged = 1;
+
+  for (int offset = 0; offset < bs->nBytes; offset += manifest->sectorSize) {
+    const int sector = (bs->addr + offset) / manifest->sectorSize;
+    written->sectorHashes[sector] =
+      crc32c(0, bs->src + offset, manifest->sectorSize);
+    written->known[sector] = 1;
+    unchanged = unchanged && manifest->known[sector] &&
+                manifest->sectorHashes[sector] == written->sectorHashes[sector];
+  }
+
+  // Units start on a sector, so do the samples of the blocks starting in them
+  const int blockSize = manifest->blockSize;
+  const int end = bs->addr + bs->nBytes;
+  const int firstBlock = (bs->addr + blockSize - 1) / blockSize;
+  for (int addr = firstBlock * blockSize; addr < end; addr += blockSize) {
+    written->sampleHashes[addr / blockSize] =
+      crc32c(0, bs->src + addr - bs->addr, MANIFEST_SAMPLE_BYTES);
+  }
+  return unchanged;
+}
+
+// Erasing the whole chip at once only pays off when every unit gets
+// programmed anyway, programming a block again costs far more than the block
+// erases saved. Reads the image through the units once more when a manifest
+// could let some of them be skipped.
+int useChipErase(const CartCommContext *ccc,
+                 WritePipeline *wp,
+                 const WriteRomOptions *options) {
+  const EraseUnit *last = &wp->units[wp->numBlocks - 1];
+  if (!ccc->chipEraseTimeoutUs || options->differential ||
+      wp->windowStart != 0 ||
+      last->addr + last->size != 1 << ccc->cfiqs.deviceSize) {
+    return 0;
+  }
+  if (!wp->manifest) {
+    return 1;
+  }
+
+  const CartManifest *manifest = wp->manifest;
+  const RomSource *source = wp->source;
+  uint8_t *scratch = wp->blocks[0].scratch;
+  for (int i = 0; i < wp->numBlocks; i++) {
+    const EraseUnit *unit = &wp->units[i];
+    const uint8_t *src =
+      source->read(source->user, unit->addr, unit->size, scratch);
+    if (!src) {
+      return 0; // Reported by the encoder
+    }
+    if (isErasedBlock(src, unit->size)) {
+      continue;
+    }
+
+    int unchanged = 1;
+    for (int offset = 0; unchanged && offset < unit->size;
+         offset += manifest->sectorSize) {
+      const int sector = (unit->addr + offset) / manifest->sectorSize;
+      unchanged = manifest->known[sector] &&
+                  manifest->sectorHashes[sector] ==
+                    crc32c(0, src + offset, manifest->sectorSize);
+    }
+    if (unchanged) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void encoderStage(WritePipeline *wp) {
+  const RomSource *source = wp->source;
+  traceThreadName("encoder");
+
+  for (int block = 0; block < wp->numBlocks; block++) {
+    BlockSlot *bs = &wp->blocks[block % blockSlots];
+    {
+      std::unique_lock<std::mutex> lock(wp->mutex);
+      wp->cond.wait(lock, [&] {
+        return wp->stop || block - wp->blocksReleased < blockSlots;
+      });
+      if (wp->stop) {
+        return;
+      }
+    }
+
+    const EraseUnit *unit = &wp->units[block];
+    bs->addr = unit->addr;
+    bs->nBytes = unit->size;
+    bs->eraseCommand = unit->command;
+    bs->src = source->read(
+      source->user, bs->addr - wp->windowStart, bs->nBytes, bs->scratch);
+    bs->failed = bs->src == nullptr;
+    bs->erased = !bs->failed && isErasedBlock(bs->src, bs->nBytes);
+    // Only blank units stay as they are after a chip erase
+    bs->unchanged = !bs->failed && wp->manifest && hashBlock(wp, bs) &&
+                    (!wp->chipErase || bs->erased);
+
+    {
+      std::lock_guard<std::mutex> lock(wp->mutex);
+      bs->ready = 1;
+    }
+    wp->cond.notify_all();
+
+    if (bs->failed) {
+      return;
+    }
+    if (!bs->erased && !bs->unchanged) {
+      encodeBlockSegments(wp, bs);
+    }
+  }
+}
+
+void verifyStage(WritePipeline *wp) {
+  traceThreadName("verifier");
+  std::unique_lock<std::mutex> lock(wp->mutex);
+
+  for (;;) {
+    wp->cond.wait(
+      lock, [&] { return wp->stop || wp->checkedBytes < wp->readBytes; });
+    if (wp->stop) {
+      return;
+    }
+
+    const int from = wp->checkedBytes;
+    const int to = wp->readBytes;
+    lock.unlock();
+
+    const int64_t traceStart = traceBegin();
+    const int differs =
+      memcmp(wp->readBack + from, wp->expected + from, to - from) != 0;
+    traceEnd("compare", traceStart, to - from);
+
+    lock.lock();
+    wp->checkedBytes = to;
+    if (differs) {
+      wp->mismatch = 1;
+    }
+    wp->cond.notify_all();
+  }
+}
+
+void onVerifyProgress(void *user, int bytesRead) {
+  auto wp = (WritePipeline *)user;
+  {
+    std::lock_guard<std::mutex> lock(wp->mutex);
+    wp->readBytes = bytesRead;
+  }
+  wp->cond.notify_all();
+}
+
+// Reads back nBytes at addr and compares them against expected on the verify
+// thread. Returns 1 if they match, 0 if they differ and -1 if the read failed.
+int readAndCompare(CartCommContext *ccc,
+                   WritePipeline *wp,
+                   int addr,
+                   const uint8_t *expected,
+                   int nBytes) {
+  {
+    std::lock_guard<std::mutex> lock(wp->mutex);
+    wp->expected = expected;
+    wp->readBytes = 0;
+    wp->checkedBytes = 0;
+    wp->mismatch = 0;
+  }
+
+  const int ret =
+    readFlash(ccc, addr, wp->readBack, nBytes, 1, onVerifyProgress, wp);
+
+  // Wait for the verify thread even on errors, it may still be using the
+  // readback buffer
+  std::unique_lock<std::mutex> lock(wp->mutex);
+  wp->cond.wait(lock, [&] { return wp->checkedBytes == wp->readBytes; });
+
+  if (ret < 0) {
+    return -1;
+  }
+  return !wp->mismatch;
+}
+
+BlockSlot *waitBlock(WritePipeline *wp, int block) {
+  BlockSlot *bs = &wp->blocks[block % blockSlots];
+  std::unique_lock<std::mutex> lock(wp->mutex);
+  wp->cond.wait(lock, [&] { return bs->ready; });
+  return bs;
+}
+
+void releaseBlock(WritePipeline *wp, BlockSlot *bs) {
+  {
+    std::lock_guard<std::mutex> lock(wp->mutex);
+    bs->ready = 0;
+    wp->blocksReleased++;
+  }
+  wp->cond.notify_all();
+}
 
-    // Erase block
+CommandSegment *waitSegment(WritePipeline *wp) {
+  std::unique_lock<std::mutex> lock(wp->mutex);
+  wp->cond.wait(lock,
+                [&] { return wp->segmentsEncoded > wp->segmentsSent; });
+  return &wp->segments[wp->segmentsSent % commandSegments];
+}
+
+// Marks the oldest encoded segment as sent and hands back to the encoder the
+// ones whose transfer already completed
+void segmentSent(WritePipeline *wp, int64_t completedWrites) {
+  {
+    std::lock_guard<std::mutex> lock(wp->mutex);
+    wp->segmentsSent++;
+    while (wp->segmentsReleased < wp->segmentsSent) {
+      const CommandSegment *seg =
+        &wp->segments[wp->segmentsReleased % commandSegments];
+      if (seg->transfer > completedWrites) {
+        break;
+      }
+      wp->segmentsReleased++;
+    }
+  }
+  wp->cond.notify_all();
+}
+
+// Sends the program commands of the current block as the encoder produces
+// them. Returns the erased bytes left out, or -1 on errors.
+int sendBlockSegments(CartCommContext *ccc, WritePipeline *wp) {
+  int skippedBytes = 0;
+
+  for (;;) {
+    CommandSegment *seg = waitSegment(wp);
+    const uint8_t lastOfBlock = seg->lastOfBlock;
+    skippedBytes += seg->skippedBytes;
+
+    // Segments fit a single transfer, so each one is tracked on its own
+    if (seg->cmds.pos > 0) {
+      const int64_t traceStart = traceBegin();
+      if (transportWrite(&ccc->usb, seg->cmds.data, seg->cmds.pos) < 0) {
+        return -1;
+      }
+      traceEnd("submitWrite", traceStart, seg->cmds.pos);
+      seg->transfer = ccc->usb.submittedWrites;
+      metricsAdd(&ccc->metrics, METRIC_BYTES_FLUSHED, seg->cmds.pos);
+      metricsAdd(&ccc->metrics, METRIC_USB_WRITES, 1);
+    } else if (ccc->usb.completedWrites < ccc->usb.submittedWrites) {
+      // A blank stretch submits nothing that would reap the earlier
+      // transfers, and the ring must not fill up with unreleased segments
+      if (transportWaitWrites(&ccc->usb) < 0) {
+        return -1;
+      }
+    }
+
+    if (lastOfBlock) {
+      if (transportWaitWrites(&ccc->usb) < 0) {
+        return -1;
+      }
+      segmentSent(wp, ccc->usb.completedWrites);
+      return skippedBytes;
+    }
+
+    // With a queue as deep as the ring, transportWrite() never reaps, so the
+    // oldest segment is released here before the encoder runs out of them.
+    // Only this thread moves the counters, so they need no lock.
+    if (wp->segmentsSent + 1 - wp->segmentsReleased >= commandSegments) {
+      const CommandSegment *oldest =
+        &wp->segments[wp->segmentsReleased % commandSegments];
+      if (transportWaitWritesUntil(&ccc->usb, oldest->transfer) < 0) {
+        return -1;
+      }
+    }
+    segmentSent(wp, ccc->usb.completedWrites);
+  }
+}
+
+// Drops the program commands of a block that does not need writing
+void dropBlockSegments(WritePipeline *wp) {
+  for (;;) {
+    const uint8_t lastOfBlock = waitSegment(wp)->lastOfBlock;
+    segmentSent(wp, 0);
+    if (lastOfBlock) {
+      return;
+    }
+  }
+}
+
+int eraseBlock(CartCommContext *ccc, const BlockSlot *bs, int blockNumber) {
+  const int64_t traceStart = traceBegin();
+  if (writeFlashCommand(ccc, bs->eraseCommand, bs->addr, 0) < 0) {
+    return -1;
+  }
+
+  const int64_t eraseUs =
+    waitFlashReady(ccc, bs->addr, erasedByte, ccc->blockEraseTimeoutUs);
+  if (eraseUs == -2) {
+    logMessage(LOG_ERROR, "ROM block %d erase timed out", blockNumber);
+  }
+  if (eraseUs < 0) {
+    return -1;
+  }
+  metricsAdd(&ccc->metrics, METRIC_BLOCKS_ERASED, 1);
+  metricsObserve(&ccc->metrics, HISTOGRAM_ERASE_US, eraseUs);
+  traceEnd("erase", traceStart, bs->nBytes);
+  logMessage(LOG_INFO,
+             "ROM Block %d erased in %d ms",
+             blockNumber,
+             (int)(eraseUs / 1000));
+  return 0;
+}
+
+int eraseChip(CartCommContext *ccc, const WritePipeline *wp) {
+  const int64_t traceStart = traceBegin();
+  if (writeFlashCommand(ccc, CMD_CHIP_ERASE) < 0) {
+    return -1;
+  }
+
+  const int64_t eraseUs =
+    waitFlashReady(ccc, 0, erasedByte, ccc->chipEraseTimeoutUs);
+  if (eraseUs == -2) {
+    logMessage(LOG_ERROR, "Chip erase timed out");
+  }
+  if (eraseUs < 0) {
+    return -1;
+  }
+  metricsAdd(&ccc->metrics, METRIC_BLOCKS_ERASED, wp->numBlocks);
+  traceEnd("chipErase", traceStart, 1 << ccc->cfiqs.deviceSize);
+  logMessage(LOG_INFO, "Chip erased in %d ms", (int)(eraseUs / 1000));
+  return 0;
+}
+
+// Sends the program commands of an erased block and waits for the chip.
+// Returns the erased bytes left out, or -1 on errors.
+int programBlock(CartCommContext *ccc,
+                 WritePipeline *wp,
+                 const BlockSlot *bs,
+                 int blockNumber) {
+  Metrics *m = &ccc->metrics;
+  const int addr = bs->addr;
+
+  const int64_t programTraceStart = traceBegin();
+  const int64_t programStart = monotonicUs();
+  if (wp->programMode == PROGRAM_BYPASS &&
+      writeFlashCommand(ccc, CMD_UNLOCK_BYPASS) < 0) {
+    return -1;
+  }
+  const int ret = sendBlockSegments(ccc, wp);
+  if (ret < 0) {
+    logMessage(LOG_ERROR, "ROM block %d write failed", blockNumber);
+    return -1;
+  }
+
+  assertInBufferEmpty();
+
+  // Bytes before the last one were paced by the command stream itself
+  const int lastByte = lastProgrammedByte(bs->src, bs->nBytes);
+  const int64_t programUs = waitFlashReady(ccc,
+                                           addr + lastByte,
+                                           reverseByte(bs->src[lastByte]),
+                                           wp->programTimeoutUs);
+  if (programUs == -2) {
+    logMessage(LOG_ERROR, "ROM block %d program timed out", blockNumber);
+  }
+  if (programUs < 0) {
+    return -1;
+  }
+  // Reads and erases need the regular command set back
+  if (wp->programMode == PROGRAM_BYPASS &&
+      writeFlashCommand(ccc, CMD_UNLOCK_BYPASS_RESET) < 0) {
+    return -1;
+  }
+  metricsAdd(m, METRIC_BLOCKS_PROGRAMMED, 1);
+  metricsObserve(m, HISTOGRAM_PROGRAM_US, monotonicUs() - programStart);
+  traceEnd("program", programTraceStart, bs->nBytes);
+  logMessage(LOG_INFO, "ROM Block %d written", blockNumber);
+  return ret;
+}
+
+int writeRomBlocks(CartCommContext *ccc,
+                   WritePipeline *wp,
+                   const WriteRomOptions *options) {
+  Metrics *m = &ccc->metrics;
+  int skippedBlocks = 0;
+  int64_t skippedBytes = 0;
+
+  logMessage(LOG_INFO,
+             "Writing %d bytes at 0x%06X in %d erase units",
+             wp->source->size,
+             wp->windowStart,
+             wp->numBlocks);
+
+  // The encoder fills the segment ring meanwhile, so programming starts
+  // right after
+  if (wp->chipErase && eraseChip(ccc, wp) < 0) {
+    return -1;
+  }
+
+  for (int block = 0; block < wp->numBlocks; block++) {
+    const int blockNumber = block + 1;
+    BlockSlot *bs = waitBlock(wp, block);
+    const int addr = bs->addr;
+
+    if (bs->failed) {
+      logMessage(LOG_ERROR, "ROM block %d image read failed", blockNumber);
+      return -1;
+    }
+
+    // Skip blocks the cart already holds according to the manifest
     //------------------------------
-    writeSST39VF168XCommand(ccc, SST_BLOCK_ERASE, addr, 0);
-    logMessage(LOG_INFO, "ROM Block %d erased", blockNumber + 1);
+    if (bs->unchanged) {
+      logMessage(LOG_INFO, "ROM Block %d unchanged (manifest)", blockNumber);
+      skippedBlocks++;
+      metricsAdd(m, METRIC_BLOCKS_SKIPPED, 1);
+      releaseBlock(wp, bs);
+      continue;
+    }
 
-    // Write block
+    // Compare against current contents
     //------------------------------
+    if (options->differential) {
+      const int64_t traceStart = traceBegin();
+      const int ret = readAndCompare(ccc, wp, addr, bs->src, bs->nBytes);
+      traceEnd("compareBlock", traceStart, bs->nBytes);
+      if (ret < 0) {
+        logMessage(LOG_ERROR, "ROM block %d compare read failed", blockNumber);
+        return -1;
+      }
+
+      if (ret == 1) {
+        logMessage(LOG_INFO, "ROM Block %d unchanged", blockNumber);
+        skippedBlocks++;
+        metricsAdd(m, METRIC_BLOCKS_SKIPPED, 1);
 
-    for (int i = 0; i < bytesToWrite; i++) {
-      enqueueSST39VF168XCommand(ccc, SST_WRITE_BYTE, addr + i, src[i]);
+        if (!bs->erased) {
+          dropBlockSegments(wp);
+        }
+        releaseBlock(wp, bs);
+        continue;
+      }
     }
 
-    if (flushOut(ccc) < 0) {
-      logMessage(LOG_ERROR, "ROM block %d write failed", blockNumber + 1);
+    // Erase block, unless the whole chip already was
+    //------------------------------
+    if (!wp->chipErase && eraseBlock(ccc, bs, blockNumber) < 0) {
       return -1;
     }
 
-    assertInBufferEmpty();
-    logMessage(LOG_INFO, "ROM Block %d written", blockNumber + 1);
+    // Write block. An erased block already holds the image and only gets
+    // verified, which also catches a failed erase.
+    //------------------------------
+    if (bs->erased) {
+      logMessage(LOG_INFO, "ROM Block %d blank", blockNumber);
+      skippedBytes += bs->nBytes;
+    } else {
+      const int ret = programBlock(ccc, wp, bs, blockNumber);
+      if (ret < 0) {
+        return -1;
+      }
+      skippedBytes += ret;
+    }
 
-    // Read back block
+    // Read back and verify block
     //------------------------------
-    if (readFlash(ccc, addr, readBackBuffer, bytesToWrite, 1) < 0) {
+    const int64_t verifyTraceStart = traceBegin();
+    const int64_t verifyStart = monotonicUs();
+    const int verified = readAndCompare(ccc, wp, addr, bs->src, bs->nBytes);
+    metricsObserve(m, HISTOGRAM_VERIFY_US, monotonicUs() - verifyStart);
+    traceEnd("verify", verifyTraceStart, bs->nBytes);
+    if (verified < 0) {
       logMessage(
-        LOG_ERROR, "ROM block %d verification read failed", blockNumber + 1);
+        LOG_ERROR, "ROM block %d verification read failed", blockNumber);
       return -1;
     }
 
-    // Verify
-    //------------------------------
-    if (memcmp(readBackBuffer, src, bytesToWrite) != 0) {
-      logMessage(
-        LOG_ERROR, "ROM block %d verification failed", blockNumber + 1);
+    if (!verified) {
+      metricsAdd(m, METRIC_VERIFY_FAILURES, 1);
+      logMessage(LOG_ERROR, "ROM block %d verification failed", blockNumber);
       return -1;
     }
 
-    logMessage(LOG_INFO, "ROM Block %d verified", blockNumber + 1);
-    blockNumber++;
+    metricsAdd(m, METRIC_BLOCKS_VERIFIED, 1);
+    logMessage(LOG_INFO, "ROM Block %d verified", blockNumber);
+    releaseBlock(wp, bs);
+  }
+
+  if (options->differential || options->manifest) {
+    logMessage(LOG_INFO,
+               "%d of %d ROM blocks unchanged and skipped",
+               skippedBlocks,
+               wp->numBlocks);
+  }
+
+  // Buffer programs only skip the data record of an erased byte. Coalesced
+  // records take their clocked out bytes only.
+  const int recordsPerByte =
+    wp->programMode == PROGRAM_BUFFER ? 1 : wp->programTemplate.records;
+  logMessage(LOG_INFO,
+             "%lld erased bytes not programmed (%lld command bytes saved)",
+             (long long)skippedBytes,
+             (long long)skippedBytes * recordsPerByte * (recordClocks / 8));
+
+  return 0;
+}
+
+// Picks the write buffer, unlock bypass or plain byte programs, and sizes the
+// command segments for them
+void setupProgramMode(const CartCommContext *ccc, WritePipeline *wp) {
+  const FlashDriver *driver = ccc->driver;
+  const int segmentRecords =
+    (commandSegmentSize - encoderSlack) / flashOutRecordSize;
+
+  if (ccc->bufferTimeoutUs) {
+    BufferProgram *bp = &wp->buffer;
+    bp->unlockAddr1 = driver->unlockAddr1;
+    bp->unlockAddr2 = driver->unlockAddr2;
+    bp->command = driver->writeBufferCommand;
+    bp->confirmCommand = 0x29;
+    bp->bufferBytes = 1 << ccc->cfiqs.maximumBytesInMultibyteProgram;
+    bp->paddingRecords = idleRecords(ccc->bufferTimeoutUs);
+
+    // Whole pages, leaving room for bufferProgramRecordsSize() worst case
+    const int pageRecords = bufferCommandRecords + bp->paddingRecords;
+    wp->programMode = PROGRAM_BUFFER;
+    wp->bytesPerSegment = (segmentRecords - 2 * pageRecords) /
+                          (pageRecords + bp->bufferBytes) * bp->bufferBytes;
+    wp->programTimeoutUs = ccc->bufferTimeoutUs;
+    logMessage(
+      LOG_INFO, "Programming through a %d byte write buffer", bp->bufferBytes);
+    return;
+  }
+
+  wp->programMode = driver->unlockBypass ? PROGRAM_BYPASS : PROGRAM_BYTE;
+  wp->paddingRecords = programPaddingRecords(ccc);
+  makeProgramTemplate(&wp->programTemplate,
+                      driver->unlockAddr1,
+                      driver->unlockAddr2,
+                      driver->programCommand,
+                      driver->unlockBypass);
+  wp->bytesPerSegment =
+    segmentRecords / (wp->programTemplate.records + wp->paddingRecords);
+  wp->programTimeoutUs = ccc->programTimeoutUs;
+  if (driver->unlockBypass) {
+    logMessage(LOG_INFO, "Programming in unlock bypass mode");
+  }
+}
+
+int writeRom(CartCommContext *ccc,
+             const RomSource *source,
+             const WriteRomOptions *options) {
+  const int chipSize = 1 << ccc->cfiqs.deviceSize;
+  const int offset = options->offset;
+  if (source->size <= 0 || offset < 0 || offset > chipSize - source->size) {
+    logMessage(LOG_ERROR,
+               "Cannot write %d bytes at 0x%X, the chip only holds %d",
+               source->size,
+               offset,
+               chipSize);
+    return -1;
+  }
+
+  const int blockSize = ccc->biggestBlockSizeBytes;
+  const int sectorSize = ccc->smallestBlockSizeBytes;
+  assert(commandSegmentSize <= ccc->usb.chunkSize);
+  const int64_t start = monotonicUs();
+
+  CartManifest *manifest = options->manifest;
+  if (manifest && (manifest->blockSize != blockSize ||
+                   manifest->sectorSize != sectorSize)) {
+    logMessage(LOG_ERROR, "Cart manifest geometry does not match the chip");
+    return -1;
+  }
+
+  EraseUnit *units = new EraseUnit[chipSize / sectorSize];
+  const int numUnits =
+    planErase(ccc, offset, offset + source->size, units);
+  const EraseUnit *lastUnit = &units[numUnits - 1];
+
+  // Cart bytes sharing the first and last erase units with the image
+  WindowSource window;
+  window.image = source;
+  window.imageOffset = offset - units[0].addr;
+  const int tailBytes = lastUnit->addr + lastUnit->size - offset - source->size;
+  uint8_t *head = new uint8_t[window.imageOffset + 1];
+  uint8_t *tail = new uint8_t[tailBytes + 1];
+  window.head = head;
+  window.tail = tail;
+  if (window.imageOffset > 0 || tailBytes > 0) {
+    logMessage(LOG_INFO,
+               "Keeping %d cart bytes around the image",
+               window.imageOffset + tailBytes);
+  }
+  if ((window.imageOffset > 0 &&
+       readFlash(ccc, units[0].addr, head, window.imageOffset, 1) < 0) ||
+      (tailBytes > 0 &&
+       readFlash(ccc, offset + source->size, tail, tailBytes, 1) < 0)) {
+    logMessage(LOG_ERROR, "Cart read around the image failed");
+    delete[] head;
+    delete[] tail;
+    delete[] units;
+    return -1;
+  }
+  const RomSource windowSource = {
+    readWindow, &window, window.imageOffset + source->size + tailBytes};
+
+  WritePipeline wp;
+  wp.stop = 0;
+  wp.source = &windowSource;
+  wp.metrics = &ccc->metrics;
+  wp.manifest = manifest;
+  wp.written = manifest ? new CartManifest(*manifest) : nullptr;
+  wp.units = units;
+  wp.numBlocks = numUnits;
+  wp.windowStart = units[0].addr;
+  setupProgramMode(ccc, &wp);
+  wp.blocksReleased = 0;
+  wp.segmentsEncoded = 0;
+  wp.segmentsSent = 0;
+  wp.segmentsReleased = 0;
+  wp.readBack = new uint8_t[blockSize];
+  wp.readBytes = 0;
+  wp.checkedBytes = 0;
+
+  for (int i = 0; i < blockSlots; i++) {
+    wp.blocks[i].scratch = new uint8_t[blockSize];
+    wp.blocks[i].ready = 0;
+  }
+  for (int i = 0; i < commandSegments; i++) {
+    wp.segments[i].cmds.data = new uint8_t[commandSegmentSize];
+    wp.segments[i].cmds.pos = 0;
+    wp.segments[i].cmds.capacity = commandSegmentSize;
+  }
+
+  wp.chipErase = useChipErase(ccc, &wp, options);
+  if (wp.chipErase) {
+    logMessage(LOG_INFO, "Every block gets rewritten, erasing the whole chip");
+  }
+
+  const LogContext logContext = getLogContext();
+  std::thread encoder([&] {
+    setLogContext(logContext);
+    encoderStage(&wp);
+  });
+  std::thread verifier([&] {
+    setLogContext(logContext);
+    verifyStage(&wp);
+  });
+
+  const int ret = writeRomBlocks(ccc, &wp, options);
+
+  {
+    std::lock_guard<std::mutex> lock(wp.mutex);
+    wp.stop = 1;
+  }
+  wp.cond.notify_all();
+  encoder.join();
+  verifier.join();
+
+  // No transfer may still point at the segments once they are freed
+  transportCancel(&ccc->usb);
 
-    src += bytesToWrite;
-    addr += bytesToWrite;
+  for (int i = 0; i < commandSegments; i++) {
+    delete[] wp.segments[i].cmds.data;
+  }
+  for (int i = 0; i < blockSlots; i++) {
+    delete[] wp.blocks[i].scratch;
   }
+  delete[] wp.readBack;
+  delete[] head;
+  delete[] tail;
 
-  delete[] readBackBuffer;
+  // The window now holds the image, the rest of the cart is untouched. A
+  // failed write leaves the window unknown.
+  if (manifest) {
+    if (ret == 0) {
+      *manifest = *wp.written;
+      manifest->fingerprint = cartFingerprint(ccc, manifest);
+    } else {
+      const int windowEnd = lastUnit->addr + lastUnit->size;
+      for (int i = wp.windowStart; i < windowEnd; i += sectorSize) {
+        manifest->known[i / sectorSize] = 0;
+      }
+    }
+    delete wp.written;
+  }
+  delete[] units;
 
+  metricsAdd(&ccc->metrics, METRIC_WRITE_US, monotonicUs() - start);
+  if (ret < 0) {
+    return -1;
+  }
+
+  metricsAdd(&ccc->metrics, METRIC_ROM_BYTES_WRITTEN, source->size);
   logMessage(LOG_INFO, "ROM write completed");
-  return romSize;
+  return source->size;
 }
 
-int readRom(CartCommContext *ccc) {
-  // TODO: Refactor if bigger chip size is ever used
-  assert((1 << ccc->cfiqs.deviceSize) <= ROM_BUFFER_SIZE);
+int sampleCart(CartCommContext *ccc, CartManifest *manifest) {
+  const int chipSize = 1 << ccc->cfiqs.deviceSize;
+  const int blockSize = ccc->biggestBlockSizeBytes;
+  const int sectorSize = ccc->smallestBlockSizeBytes;
+  uint8_t sample[MANIFEST_SAMPLE_BYTES];
 
-  int numBlocks = (1 << ccc->cfiqs.deviceSize) / ccc->biggestBlockSizeBytes;
-  for (int i = 0; i < numBlocks; i++) {
-    const int addr = i * ccc->biggestBlockSizeBytes;
-    if (readFlash(
-          ccc, addr, &ccc->romBuffer[addr], ccc->biggestBlockSizeBytes, 1) <
-        0) {
-      logMessage(LOG_ERROR, "Cart ROM read failed");
+  if (chipSize / blockSize > MAX_MANIFEST_BLOCKS ||
+      chipSize / sectorSize > MAX_MANIFEST_SECTORS) {
+    logMessage(LOG_ERROR, "Too many sectors for a cart manifest");
+    return -1;
+  }
+
+  manifest->blockSize = blockSize;
+  manifest->numBlocks = chipSize / blockSize;
+  manifest->sectorSize = sectorSize;
+  manifest->numSectors = chipSize / sectorSize;
+  for (int i = 0; i < manifest->numBlocks; i++) {
+    if (readFlash(ccc, i * blockSize, sample, sizeof(sample), 1) < 0) {
+      logMessage(LOG_ERROR, "Cart sample read failed");
       return -1;
     }
-    logMessage(LOG_INFO, "Read block: %d/%d", i + 1, numBlocks);
+    manifest->sampleHashes[i] = crc32c(0, sample, sizeof(sample));
+  }
+  for (int i = 0; i < manifest->numSectors; i++) {
+    manifest->known[i] = 0;
   }
 
-  logMessage(LOG_INFO, "ROM read completed");
-  return numBlocks * ccc->biggestBlockSizeBytes;
+  manifest->fingerprint = cartFingerprint(ccc, manifest);
+  return 0;
 }
 
-// TODO: Opens first device matching descriptor for now. Allow listing and
-// selecting devices
-int openDeviceAndSetupMPSSE(struct ftdi_context *ftdi, CartCommContext *ccc) {
-  ftdi->usb_write_timeout = 10000;
-  ftdi->usb_read_timeout = 10000;
-  // Init context
-  ccc->mpsseOn = 0;
-  ccc->poweredOn = 0;
+uint32_t cartFingerprint(const CartCommContext *ccc,
+                         const CartManifest *manifest) {
+  const uint32_t crc = crc32c(0, ccc->chipId, sizeof(ccc->chipId));
+  return crc32c(crc,
+                (const uint8_t *)manifest->sampleHashes,
+                manifest->numBlocks * sizeof(manifest->sampleHashes[0]));
+}
 
-  {
-    int ret;
-    if ((ret = ftdi_usb_open(ftdi, CHIP_VENDOR, CHIP_PRODUCT)) != 0) {
-      logMessage(LOG_ERROR,
-                 "Unable to open ftdi device: %d (%s)",
-                 ret,
-                 ftdi_get_error_string(ftdi));
-      ftdi_free(ftdi);
+// Reads sampleSize bytes at each of the count addresses into dst, as the
+// flash holds them, with as few flushes as the read batch allows
+int readFlashSamples(CartCommContext *ccc,
+                     const int *addrs,
+                     int count,
+                     int sampleSize,
+                     uint8_t *dst) {
+  setCS(ccc, 0);
+  cartSleepMs(ccc, 1);
+
+  int perRequest = ccc->readBatchSize / sampleSize;
+  perRequest = perRequest > 0 ? perRequest : 1;
+  for (int first = 0; first < count; first += perRequest) {
+    const int n = count - first < perRequest ? count - first : perRequest;
+    for (int i = first; i < first + n; i++) {
+      encodeReadRecords(&ccc->out, addrs[i], sampleSize, 0);
+    }
+    enqueueByteOut(ccc, 0x87);
+    if (flushOut(ccc) < 0) {
       return -1;
     }
+    readSync(dst + first * sampleSize, n * sampleSize);
   }
+  return 0;
+}
 
-  // Init CartCommContext
-  ccc->ftdi = ftdi;
-  ccc->outBufferPos = 0;
+// Probes read from every sector by probeDataEnd(): evenly spaced from its
+// head, plus its tail
+const int probesPerSector = 8;
+const int probeBytes = 64;
+
+// Finds where the programmed data in [start, end) ends, probing the blocks
+// from the last one down until some probe is not erased. Every sector is
+// probed, as images end on any sector and erased sectors need not follow a
+// programmed one. The probes of a block go out in one batch. readRom() reads
+// the block found in full, but data in a later sector that falls entirely
+// between its probes goes unnoticed. Returns the end of the block, start if
+// none was found or -1 on errors.
+int probeDataEnd(CartCommContext *ccc, int start, int end) {
+  const int blockSize = ccc->biggestBlockSizeBytes;
+  const int sectorSize = ccc->smallestBlockSizeBytes;
+  const int spacing = sectorSize / probesPerSector;
+  int probeSize = spacing < probeBytes ? spacing : probeBytes;
+  probeSize = end - start < probeSize ? end - start : probeSize;
+  if (probeSize <= 0) {
+    return start;
+  }
 
-  // Steps following the oficial guide to setup MPSSE
-  //------------------------------
+  const int maxProbes = blockSize / sectorSize * (probesPerSector + 1);
+  int *addrs = new int[maxProbes];
+  uint8_t *probes = new uint8_t[maxProbes * probeSize];
+  int ret = start;
+
+  for (int blockStart = (end - 1) / blockSize * blockSize;
+       blockStart + blockSize > start;
+       blockStart -= blockSize) {
+    int count = 0;
+    for (int sector = blockStart; sector < blockStart + blockSize;
+         sector += sectorSize) {
+      if (sector + sectorSize <= start || sector >= end) {
+        continue;
+      }
+      for (int i = 0; i <= probesPerSector; i++) {
+        int from = i < probesPerSector ? sector + i * spacing
+                                       : sector + sectorSize - probeSize;
+        from = from < start ? start : from;
+        from = from + probeSize > end ? end - probeSize : from;
+        addrs[count++] = from;
+      }
+    }
 
-  // Reset device
-  CALL_FTDI(ftdi_usb_reset, "Unable to reset device");
+    if (readFlashSamples(ccc, addrs, count, probeSize, probes) < 0) {
+      ret = -1;
+      break;
+    }
+    if (lastProgrammedByte(probes, count * probeSize) >= 0) {
+      ret = blockStart + blockSize < end ? blockStart + blockSize : end;
+      break;
+    }
+  }
 
-  // Set chunk sizes to 64KiB
-  const int chunkSize = 65536;
+  delete[] addrs;
+  delete[] probes;
+  return ret;
+}
 
-  CALL_FTDI(
-    ftdi_write_data_set_chunksize, "Unable to set write chunk size", chunkSize);
-  CALL_FTDI(
-    ftdi_read_data_set_chunksize, "Unable to set read chunk size", chunkSize);
+int readRom(CartCommContext *ccc,
+            const RomSink *sink,
+            const ReadRomOptions *options) {
+  const int chipSize = 1 << ccc->cfiqs.deviceSize;
+  const int blockSize = ccc->biggestBlockSizeBytes;
+  const int from = options->offset;
+  int to = options->length ? from + options->length : chipSize;
+  if (from < 0 || from >= chipSize || to <= from || to > chipSize) {
+    logMessage(LOG_ERROR,
+               "Read range 0x%X-0x%X is outside the %d byte chip",
+               from,
+               to,
+               chipSize);
+    return -1;
+  }
 
-  // Disable special chars
-  CALL_FTDI(ftdi_set_event_char, "Unable to reset event char", 0, 0);
-  CALL_FTDI(ftdi_set_error_char, "Unable to reset error char", 0, 0);
+  const int64_t start = monotonicUs();
+  if (options->autoSize) {
+    to = probeDataEnd(ccc, from, to);
+    if (to < 0) {
+      logMessage(LOG_ERROR, "Cart probe read failed");
+      return -1;
+    }
+    logMessage(LOG_INFO, "Programmed data ends before 0x%06X", to);
+  }
 
-  // Set timeout that is used to flush remaining data from the receive buffer in
-  // milliseconds.
-  CALL_FTDI(ftdi_set_latency_timer, "Unable to set latency", latencyMs);
+  const int numBlocks = (to - from + blockSize - 1) / blockSize;
+  uint8_t *block = new uint8_t[blockSize];
+  int bytesRead = 0;
+  int i;
 
-  // Turn on flow control so no read requests are generated while buffer is full
-  CALL_FTDI(ftdi_setflowctrl, "Unable to turn on flow control", SIO_RTS_CTS_HS);
+  for (i = 0; i < numBlocks; i++) {
+    const int addr = from + i * blockSize;
+    const int nBytes = to - addr < blockSize ? to - addr : blockSize;
+    const int64_t traceStart = traceBegin();
+    if (readFlash(ccc, addr, block, nBytes, 1) < 0) {
+      logMessage(LOG_ERROR, "Cart ROM read failed");
+      break;
+    }
+    traceEnd("readBlock", traceStart, nBytes);
+    metricsAdd(&ccc->metrics, METRIC_ROM_BYTES_READ, nBytes);
+
+    // Auto sized dumps leave the trailing erased bytes out
+    const int keep = options->autoSize && i == numBlocks - 1
+                       ? lastProgrammedByte(block, nBytes) + 1
+                       : nBytes;
+    if (keep > 0 && sink->write(sink->user, block, keep) < 0) {
+      logMessage(LOG_ERROR, "Unable to store ROM block %d", i + 1);
+      break;
+    }
+    bytesRead += keep;
+    logMessage(LOG_INFO, "Read block: %d/%d", i + 1, numBlocks);
+  }
+
+  delete[] block;
+  metricsAdd(&ccc->metrics, METRIC_READ_US, monotonicUs() - start);
+  if (i < numBlocks) {
+    return -1;
+  }
+
+  logMessage(LOG_INFO, "ROM read completed: %d bytes", bytesRead);
+  return bytesRead;
+}
+
+// Largest read request whose answers fit the chip buffer, in whole USB
+// packets (each one carries 2 modem status bytes)
+void setupReadBatch(CartCommContext *ccc) {
+  const int packetPayload = ccc->usb.maxPacketSize - 2;
+  const int bufferSize = ccc->usb.rxBufferSize;
+
+  ccc->maxReadBatchSize = bufferSize / packetPayload * packetPayload;
+  if (ccc->maxReadBatchSize > IN_BUFFER_SIZE) {
+    ccc->maxReadBatchSize = IN_BUFFER_SIZE / packetPayload * packetPayload;
+  }
+  if (ccc->maxReadBatchSize == 0) {
+    ccc->maxReadBatchSize = bufferSize;
+  }
+  ccc->readBatchSize = ccc->maxReadBatchSize;
+}
 
-  // Reset controller
-  CALL_FTDI(ftdi_set_bitmode, "Unable to reset controller", 0x00, 0x00);
-  // Enable MPSSE mode
-  CALL_FTDI(ftdi_set_bitmode, "Unable to enable MPSSE mode", 0x00, 0x02);
+int tuneReadBatch(CartCommContext *ccc) {
+  const int sampleSize = 16 * 1024;
+  const int candidates = 4;
+
+  uint8_t *sample = new uint8_t[sampleSize];
+  int bestBatch = ccc->maxReadBatchSize;
+  int64_t bestUs = -1;
+
+  for (int i = 0; i < candidates; i++) {
+    const int batch = ccc->maxReadBatchSize >> i;
+    if (batch < 64) {
+      break;
+    }
+
+    ccc->readBatchSize = batch;
+    const int64_t start = monotonicUs();
+    if (readFlash(ccc, 0, sample, sampleSize) < 0) {
+      delete[] sample;
+      return -1;
+    }
+    const int64_t elapsed = monotonicUs() - start;
+
+    logMessage(LOG_INFO,
+               "Read batch %d: %d KiB/s",
+               batch,
+               (int)((int64_t)sampleSize * 1000000 / 1024 / (elapsed + 1)));
+
+    if (bestUs < 0 || elapsed < bestUs) {
+      bestUs = elapsed;
+      bestBatch = batch;
+    }
+  }
+
+  delete[] sample;
+  ccc->readBatchSize = bestBatch;
+  return bestBatch;
+}
+
+int openDeviceAndSetupMPSSE(CartCommContext *ccc, const char *device) {
+  // Init context
+  ccc->mpsseOn = 0;
+  ccc->poweredOn = 0;
+  metricsReset(&ccc->metrics);
+
+  if (transportOpen(&ccc->usb,
+                    device,
+                    ccc->usbQueueDepth ? ccc->usbQueueDepth
+                                       : DEFAULT_USB_QUEUE_DEPTH,
+                    usbChunkSize) < 0) {
+    return -1;
+  }
+
+  // Init CartCommContext
+  snprintf(ccc->serial, sizeof(ccc->serial), "%s", ccc->usb.serial);
+  setupReadBatch(ccc);
+  ccc->out.data = ccc->outBuffer;
+  ccc->out.pos = 0;
+  ccc->out.capacity = OUT_BUFFER_SIZE;
+
+  if (transportSetup(&ccc->usb) < 0) {
+    return -1;
+  }
 
   // Sync with MPSSE
   //
@@ -613,24 +1996,33 @@ int openDeviceAndSetupMPSSE(struct ftdi_context *ftdi, CartCommContext *ccc) {
 
   // Set TCK/SK Clock divisor
   // TODO: This is different if divide by 5 was disabled (60Mhz)
-  // TCK/SK period = 12MHz  /  (( 1 +[ (0xValueH * 256) OR 0xValueL] ) * 2)
-  // For 3MHz: 0x0000
-  enqueueByteOut(ccc, 0x86); // Command
-  enqueueByteOut(ccc, 0x01); // ValueL
-  enqueueByteOut(ccc, 0x00); // ValueH
+  // See clockDivisor
+  enqueueByteOut(ccc, 0x86);                       // Command
+  enqueueByteOut(ccc, clockDivisor & 0xFF);        // ValueL
+  enqueueByteOut(ccc, (clockDivisor >> 8) & 0xFF); // ValueH
   flushOut(ccc);
   assertInBufferEmpty();
 
-  sleepMs(10);
+  cartSleepMs(ccc, 10);
   ccc->mpsseOn = 1;
   logMessage(LOG_INFO, "FTDI Device Ready");
+  logMessage(LOG_INFO,
+             "FTDI chip type %d, serial %s, max read batch %d bytes",
+             ccc->usb.chipType,
+             ccc->serial,
+             ccc->maxReadBatchSize);
 
   // Power on!
   powerOn(ccc);
   assertInBufferEmpty();
   logMessage(LOG_INFO, "Programmer powered on");
 
-  // Check chip info
+  return identifyFlashChip(ccc);
+}
+
+int identifyFlashChip(CartCommContext *ccc) {
+  // Check chip info, with the common command set until the chip is known
+  ccc->driver = jedecFlashDriver;
   if (readChipId(ccc) < 0) {
     logMessage(LOG_ERROR, "Flash chip ID Read Failed");
     return -1;
@@ -639,26 +2031,28 @@ int openDeviceAndSetupMPSSE(struct ftdi_context *ftdi, CartCommContext *ccc) {
   logMessage(LOG_INFO, "Flash chip Manufacturer Id: %X", ccc->chipId[0]);
   logMessage(LOG_INFO, "Flash chip Device Id: %X", ccc->chipId[1]);
 
-  // TODO: Might need refactor if different chips are used
-  // Validate Chip Id Info
-  if (ccc->chipId[0] != 0xBF) {
-    logMessage(LOG_ERROR, "Wrong chip manufacturer");
+  if (readCFIQueryStruct(ccc) < 0) {
+    logMessage(LOG_ERROR, "Read CFI Query Struct failed");
     return -1;
   }
 
-  if (ccc->chipId[1] != 0xC8) {
-    logMessage(LOG_ERROR, "Wrong chip manufacturer");
+  if (selectFlashDriver(ccc) < 0) {
     return -1;
   }
 
-  if (readCFIQueryStruct(ccc) < 0) {
-    logMessage(LOG_ERROR, "Read CFI Query Struct failed");
+  dumpCFIDataToLog(ccc);
+
+  if (ccc->duplexDataBit && checkDuplexReads(ccc) < 0) {
+    logMessage(LOG_ERROR, "Full-duplex check read failed");
     return -1;
   }
 
-  dumpCFIDataToLog(ccc);
-
   logMessage(LOG_INFO, "Flash chip ready");
 
   return 0;
 }
+
+void closeDevice(CartCommContext *ccc) {
+  transportClose(&ccc->usb);
+  ccc->mpsseOn = 0;
+}
@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "checksum.hpp"
+#include <cstring>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+const uint32_t castagnoliPolynomial = 0x82F63B78; // Reflected
+
+struct CrcTable {
+  uint32_t entries[256];
+
+  CrcTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = crc & 1 ? (crc >> 1) ^ castagnoliPolynomial : crc >> 1;
+      }
+      entries[i] = crc;
+    }
+  }
+};
+
+const CrcTable crcTable;
+
+} // namespace
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, int nBytes) {
+  crc = ~crc;
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+  for (; nBytes >= 8; nBytes -= 8, data += 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = (uint32_t)_mm_crc32_u64(crc, word);
+  }
+#endif
+
+  for (int i = 0; i < nBytes; i++) {
+    crc = crcTable.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+uint32_t crc32cFill(uint32_t crc, uint8_t byte, int nBytes) {
+  uint8_t fill[256];
+  memset(fill, byte, sizeof(fill));
+
+  while (nBytes > 0) {
+    const int n = nBytes > (int)sizeof(fill) ? (int)sizeof(fill) : nBytes;
+    crc = crc32c(crc, fill, n);
+    nBytes -= n;
+  }
+  return crc;
+}
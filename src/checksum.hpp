@@ -0,0 +1,35 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+
+#include <cstdint>
+
+// CRC32C (Castagnoli) of nBytes of data, continuing from crc. Start with 0.
+// Uses the SSE4.2 crc32 instruction when the compiler targets it.
+uint32_t crc32c(uint32_t crc, const uint8_t *data, int nBytes);
+
+// Same as feeding nBytes copies of byte to crc32c()
+uint32_t crc32cFill(uint32_t crc, uint8_t byte, int nBytes);
+
+#endif
@@ -0,0 +1,833 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "hm05.hpp"
+#include "emulator.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// SST39VF1681 model
+//------------------------------
+
+const int flashSize = 2 * 1024 * 1024;
+const int flashBlockSize = 64 * 1024;
+const int flashSectorSize = 4 * 1024;
+
+// SST39VF1681 datasheet typical times
+const int defaultProgramUs = 7;
+const int defaultBufferProgramUs = 120;
+const int defaultBlockEraseUs = 18000;
+const int defaultSectorEraseUs = 18000;
+const int defaultChipEraseUs = 40000;
+
+// Largest write buffer of the emulated chips
+const int maxWriteBufferSize = 32;
+
+// CFI query tables from address 0x10 on
+const uint8_t sstCfiTable[] = {'Q',  'R',  'Y',  0x01, 0x07, 0x00, 0x00, 0x00,
+                               0x00, 0x00, 0x00, 0x27, 0x36, 0x00, 0x00, 0x04,
+                               0x00, 0x04, 0x06, 0x01, 0x00, 0x01, 0x01, 0x15,
+                               0x00, 0x00, 0x00, 0x00, 0x02, 0xFF, 0x01, 0x10,
+                               0x00, 0x1F, 0x00, 0x00, 0x01};
+// AMD/Fujitsu standard command set, uniform 64 KiB blocks, byte mode only
+const uint8_t amdCfiTable[] = {'Q',  'R',  'Y',  0x02, 0x00, 0x00, 0x00, 0x00,
+                               0x00, 0x00, 0x00, 0x27, 0x36, 0x00, 0x00, 0x03,
+                               0x00, 0x09, 0x0E, 0x01, 0x00, 0x02, 0x02, 0x15,
+                               0x00, 0x00, 0x00, 0x00, 0x01, 0x1F, 0x00, 0x00,
+                               0x01};
+// Same with a 32 byte write buffer
+const uint8_t amdBufferCfiTable[] = {
+  'Q',  'R',  'Y',  0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x27, 0x36, 0x00, 0x00, 0x03, 0x07, 0x09, 0x0E, 0x01, 0x01, 0x02,
+  0x02, 0x15, 0x00, 0x00, 0x05, 0x00, 0x01, 0x1F, 0x00, 0x00, 0x01};
+const int cfiTableAddr = 0x10;
+
+// Chips the emulator models, selected with the chip option
+struct EmulatedChip {
+  const char *name;
+  uint8_t manufacturerId;
+  uint8_t deviceId;
+  const uint8_t *cfiTable;
+  int cfiTableSize;
+  uint8_t sectorErase;  // 0x50 erases 4 KiB sectors
+  uint8_t unlockBypass; // 0x20 enters the unlock bypass mode
+  int writeBufferSize;  // 0x25 loads the write buffer, 0 if there is none
+};
+
+const EmulatedChip emulatedChips[] = {
+  {"sst39vf1681", 0xBF, 0xC8, sstCfiTable, sizeof(sstCfiTable), 1, 0, 0},
+  {"s29al016", 0x01, 0x49, amdCfiTable, sizeof(amdCfiTable), 0, 1, 0},
+  // An Id no driver lists, so the CFI command set picks the driver
+  {"amd-buffer",
+   0x01,
+   0x7E,
+   amdBufferCfiTable,
+   sizeof(amdBufferCfiTable),
+   0,
+   0,
+   maxWriteBufferSize},
+};
+
+enum FlashMode {
+  FLASH_READ,
+  FLASH_ID,
+  FLASH_CFI,
+};
+
+// Position in the unlock/command cycle sequences
+enum FlashCycle {
+  CYCLE_IDLE,
+  CYCLE_UNLOCK1,
+  CYCLE_UNLOCK2,
+  CYCLE_PROGRAM,
+  CYCLE_ERASE_UNLOCK1,
+  CYCLE_ERASE_UNLOCK2,
+  CYCLE_ERASE,
+  CYCLE_BYPASS_RESET,
+  CYCLE_BUFFER_COUNT,
+  CYCLE_BUFFER_LOAD,
+  CYCLE_BUFFER_CONFIRM,
+};
+
+struct EmulatedFlash {
+  uint8_t mem[flashSize];
+  const EmulatedChip *chip;
+  FlashCycle cycle;
+  FlashMode mode;
+  uint8_t bypass; // In unlock bypass mode
+  double busyUntilUs; // Erase or program in progress until then
+  uint8_t busyErasing;
+  uint8_t busyData; // Byte being programmed
+  uint8_t toggle;   // DQ6 toggle bit
+  int programUs;
+  int bufferProgramUs;
+  int blockEraseUs;
+  int sectorEraseUs;
+  int chipEraseUs;
+  // Write buffer being loaded
+  int bufferPage;
+  int bufferLeft;
+  int bufferCount;
+  int bufferAddrs[maxWriteBufferSize];
+  uint8_t bufferData[maxWriteBufferSize];
+
+  int64_t programs;
+  int64_t erases;
+  int64_t busyReads;
+  int64_t ignoredWrites; // Cycles sent while busy
+};
+
+uint8_t flashRead(EmulatedFlash *flash, int addr, double nowUs) {
+  if (nowUs < flash->busyUntilUs) {
+    // Status: DQ7 shows the complement of the data, DQ6 toggles
+    flash->busyReads++;
+    flash->toggle ^= 0x40;
+    const uint8_t dq7 = flash->busyErasing ? 0 : ~flash->busyData & 0x80;
+    return dq7 | flash->toggle;
+  }
+
+  const int offset = addr & 0xFF;
+  switch (flash->mode) {
+    case FLASH_ID:
+      return offset == 0   ? flash->chip->manufacturerId
+             : offset == 1 ? flash->chip->deviceId
+                           : 0x00;
+    case FLASH_CFI:
+      if (offset >= cfiTableAddr &&
+          offset < cfiTableAddr + flash->chip->cfiTableSize) {
+        return flash->chip->cfiTable[offset - cfiTableAddr];
+      }
+      return 0x00;
+    default:
+      return flash->mem[addr & (flashSize - 1)];
+  }
+}
+
+void flashErase(EmulatedFlash *flash,
+                int addr,
+                int size,
+                int us,
+                double nowUs) {
+  memset(&flash->mem[addr & (flashSize - 1) & ~(size - 1)], erasedByte, size);
+  flash->busyUntilUs = nowUs + us;
+  flash->busyErasing = 1;
+  flash->erases++;
+}
+
+void flashWrite(EmulatedFlash *flash, int addr, uint8_t data, double nowUs) {
+  if (nowUs < flash->busyUntilUs) {
+    flash->ignoredWrites++;
+    return;
+  }
+
+  const int cmdAddr = addr & 0xFFF;
+  const int isUnlock1 = cmdAddr == 0xAAA && data == 0xAA;
+  const int isUnlock2 = cmdAddr == 0x555 && data == 0x55;
+
+  switch (flash->cycle) {
+    case CYCLE_IDLE:
+      if (flash->bypass) {
+        // Program and reset take no unlock cycles, at any address
+        if (data == 0xA0) {
+          flash->cycle = CYCLE_PROGRAM;
+        } else if (data == 0x90) {
+          flash->cycle = CYCLE_BYPASS_RESET;
+        }
+      } else if (isUnlock1) {
+        flash->cycle = CYCLE_UNLOCK1;
+      } else if (data == 0xF0) {
+        flash->mode = FLASH_READ;
+      }
+      break;
+    case CYCLE_UNLOCK1:
+      flash->cycle = isUnlock2 ? CYCLE_UNLOCK2 : CYCLE_IDLE;
+      break;
+    case CYCLE_UNLOCK2:
+      flash->cycle = CYCLE_IDLE;
+      // Write to buffer goes to the page address
+      if (data == 0x25 && flash->chip->writeBufferSize) {
+        flash->bufferPage = addr & ~(flash->chip->writeBufferSize - 1);
+        flash->cycle = CYCLE_BUFFER_COUNT;
+        break;
+      }
+      if (cmdAddr != 0xAAA) {
+        break;
+      }
+      switch (data) {
+        case 0x90:
+          flash->mode = FLASH_ID;
+          break;
+        case 0x98:
+          flash->mode = FLASH_CFI;
+          break;
+        case 0xF0:
+          flash->mode = FLASH_READ;
+          break;
+        case 0xA0:
+          flash->cycle = CYCLE_PROGRAM;
+          break;
+        case 0x80:
+          flash->cycle = CYCLE_ERASE_UNLOCK1;
+          break;
+        case 0x20:
+          flash->bypass = flash->chip->unlockBypass;
+          break;
+      }
+      break;
+    case CYCLE_PROGRAM:
+      // Programming can only clear bits
+      flash->cycle = CYCLE_IDLE;
+      flash->mem[addr & (flashSize - 1)] &= data;
+      flash->busyUntilUs = nowUs + flash->programUs;
+      flash->busyErasing = 0;
+      flash->busyData = data;
+      flash->programs++;
+      break;
+    case CYCLE_ERASE_UNLOCK1:
+      flash->cycle = isUnlock1 ? CYCLE_ERASE_UNLOCK2 : CYCLE_IDLE;
+      break;
+    case CYCLE_ERASE_UNLOCK2:
+      flash->cycle = isUnlock2 ? CYCLE_ERASE : CYCLE_IDLE;
+      break;
+    case CYCLE_ERASE:
+      flash->cycle = CYCLE_IDLE;
+      if (data == 0x30) {
+        flashErase(flash, addr, flashBlockSize, flash->blockEraseUs, nowUs);
+      } else if (data == 0x50 && flash->chip->sectorErase) {
+        flashErase(flash, addr, flashSectorSize, flash->sectorEraseUs, nowUs);
+      } else if (data == 0x10 && cmdAddr == 0xAAA) {
+        flashErase(flash, 0, flashSize, flash->chipEraseUs, nowUs);
+      }
+      break;
+    case CYCLE_BYPASS_RESET:
+      flash->cycle = CYCLE_IDLE;
+      if (data == 0x00) {
+        flash->bypass = 0;
+      }
+      break;
+    case CYCLE_BUFFER_COUNT:
+      // Counts past the buffer abort the load
+      flash->bufferLeft = data + 1;
+      flash->bufferCount = 0;
+      flash->cycle = flash->bufferLeft <= flash->chip->writeBufferSize
+                       ? CYCLE_BUFFER_LOAD
+                       : CYCLE_IDLE;
+      break;
+    case CYCLE_BUFFER_LOAD:
+      if ((addr & ~(flash->chip->writeBufferSize - 1)) != flash->bufferPage) {
+        flash->cycle = CYCLE_IDLE;
+        break;
+      }
+      flash->bufferAddrs[flash->bufferCount] = addr;
+      flash->bufferData[flash->bufferCount++] = data;
+      if (--flash->bufferLeft == 0) {
+        flash->cycle = CYCLE_BUFFER_CONFIRM;
+      }
+      break;
+    case CYCLE_BUFFER_CONFIRM:
+      flash->cycle = CYCLE_IDLE;
+      if (data != 0x29) {
+        break;
+      }
+      for (int i = 0; i < flash->bufferCount; i++) {
+        flash->mem[flash->bufferAddrs[i] & (flashSize - 1)] &=
+          flash->bufferData[i];
+      }
+      flash->busyUntilUs = nowUs + flash->bufferProgramUs;
+      flash->busyErasing = 0;
+      flash->busyData = flash->bufferData[flash->bufferCount - 1];
+      flash->programs += flash->bufferCount;
+      break;
+  }
+}
+
+// FT2232H + cart model
+//------------------------------
+
+const int emulatedRxBufferSize = 4096; // Chip to host
+const int emulatedTxBufferSize = 4096; // Host to chip
+const int emulatedPacketSize = 512;
+const double mpsseBaseClockMHz = 12.0;
+
+struct Emulator {
+  EmulatedFlash flash;
+
+  // Commands received but not run yet, the MPSSE stalls while its answer
+  // buffer is full
+  uint8_t *cmds;
+  int cmdsLength;
+  int cmdsCapacity;
+
+  // Answers waiting for the host
+  uint8_t rx[emulatedRxBufferSize];
+  double rxUs[emulatedRxBufferSize]; // Device time each answer was ready
+  int rxHead;
+  int rxCount;
+
+  uint8_t loopback;
+  uint8_t lowBits;
+  double clockUs; // SPI clock period
+
+  // Cart shift register
+  int bitCount;
+  uint32_t shift;
+  uint8_t isWrite;
+  uint8_t outByte; // Flash data shifted out on a read record
+
+  // Emulated time, on the monotonicUs() clock when running in real time
+  uint8_t realtime;
+  double latencyUs;
+  double bytesPerUs;
+  double hostUs;     // Host time when not running in real time
+  double openUs;
+  double linkFreeUs; // USB link busy with earlier transfers until then
+  double deviceUs;   // MPSSE busy running commands until then
+
+  char image[1024];
+  int64_t cmdBytes;
+  int64_t usbWrites;
+  int64_t usbReads;
+};
+
+struct EmulatedTransfer {
+  double doneUs;
+};
+
+double emulatorNow(Emulator *emu) {
+  return emu->realtime ? (double)monotonicUs() : emu->hostUs;
+}
+
+// Blocks the host until the emulated time us
+void emulatorWaitUntil(Emulator *emu, double us) {
+  if (!emu->realtime) {
+    if (us > emu->hostUs) {
+      emu->hostUs = us;
+    }
+    return;
+  }
+
+  const int64_t delta = (int64_t)us - monotonicUs();
+  if (delta > 0) {
+    timespec req = {(time_t)(delta / 1000000), (long)(delta % 1000000) * 1000};
+    nanosleep(&req, nullptr);
+  }
+}
+
+void pushRx(Emulator *emu, uint8_t byte) {
+  assert(emu->rxCount < emulatedRxBufferSize);
+  const int tail = (emu->rxHead + emu->rxCount++) % emulatedRxBufferSize;
+  emu->rx[tail] = byte;
+  emu->rxUs[tail] = emu->deviceUs;
+}
+
+void cartClock(Emulator *emu, int bit) {
+  EmulatedFlash *flash = &emu->flash;
+  emu->deviceUs += emu->clockUs;
+
+  // Write flag and address
+  if (emu->bitCount < 24) {
+    emu->shift = (emu->shift << 1) | bit;
+    emu->bitCount++;
+    if (emu->bitCount == 24) {
+      emu->isWrite = (emu->shift & 0x800000) != 0;
+      if (!emu->isWrite) {
+        emu->outByte = flashRead(flash, emu->shift & 0x1FFFFF, emu->deviceUs);
+      }
+    }
+    return;
+  }
+
+  // Data
+  if (emu->isWrite) {
+    emu->shift = (emu->shift << 1) | bit;
+  }
+  emu->bitCount++;
+  if (emu->bitCount == 32) {
+    if (emu->isWrite) {
+      flashWrite(flash,
+                 (emu->shift >> 8) & 0x1FFFFF,
+                 emu->shift & 0xFF,
+                 emu->deviceUs);
+    }
+    emu->bitCount = 0;
+    emu->shift = 0;
+  }
+}
+
+int cartOutBit(Emulator *emu) {
+  if (emu->bitCount >= 24 && !emu->isWrite) {
+    return (emu->outByte >> (7 - (emu->bitCount - 24))) & 1;
+  }
+  return 1;
+}
+
+int shiftBit(Emulator *emu, int outBit) {
+  const int inBit = emu->loopback ? outBit : cartOutBit(emu);
+  cartClock(emu, outBit);
+  return inBit;
+}
+
+uint8_t shiftBits(Emulator *emu, uint8_t out, int lsbFirst, int nBits) {
+  uint8_t in = 0;
+  for (int i = 0; i < nBits; i++) {
+    const int bit = lsbFirst ? i : 7 - i;
+    in |= shiftBit(emu, (out >> bit) & 1) << bit;
+  }
+  // MSB first bit transfers end up in the low bits
+  if (nBits < 8 && !lsbFirst) {
+    in >>= 8 - nBits;
+  }
+  return in;
+}
+
+void setLowBits(Emulator *emu, uint8_t bits) {
+  // CS high resets the cart shift register
+  if (bits & 0x08) {
+    emu->bitCount = 0;
+    emu->shift = 0;
+  }
+  emu->lowBits = bits;
+}
+
+void badCommand(Emulator *emu, uint8_t opcode) {
+  pushRx(emu, 0xFA);
+  pushRx(emu, opcode);
+}
+
+// Runs the command at cmd. Returns the bytes it takes, or 0 if it is not
+// complete yet or its answer doesn't fit the buffer.
+int runCommand(Emulator *emu, const uint8_t *cmd, int available) {
+  const uint8_t opcode = cmd[0];
+  const int rxFree = emulatedRxBufferSize - emu->rxCount;
+
+  // Data shifting commands
+  if (opcode < 0x80 && !(opcode & 0x40)) {
+    const int bitMode = opcode & 0x02;
+    const int lsbFirst = opcode & 0x08;
+    const int writes = opcode & 0x10;
+    const int reads = opcode & 0x20;
+
+    if (!writes && !reads) {
+      if (rxFree < 2) {
+        return 0;
+      }
+      badCommand(emu, opcode);
+      return 1;
+    }
+
+    if (bitMode) {
+      const int size = writes ? 3 : 2;
+      if (available < size || (reads && rxFree < 1)) {
+        return 0;
+      }
+      const uint8_t in =
+        shiftBits(emu, writes ? cmd[2] : 0, lsbFirst, cmd[1] + 1);
+      if (reads) {
+        pushRx(emu, in);
+      }
+      return size;
+    }
+
+    if (available < 3) {
+      return 0;
+    }
+    const int length = (cmd[1] | (cmd[2] << 8)) + 1;
+    const int size = 3 + (writes ? length : 0);
+    if (available < size || (reads && rxFree < length)) {
+      return 0;
+    }
+    for (int i = 0; i < length; i++) {
+      const uint8_t in = shiftBits(emu, writes ? cmd[3 + i] : 0, lsbFirst, 8);
+      if (reads) {
+        pushRx(emu, in);
+      }
+    }
+    return size;
+  }
+
+  switch (opcode) {
+    case 0x80: // Set low data bits
+      if (available < 3) {
+        return 0;
+      }
+      setLowBits(emu, cmd[1]);
+      return 3;
+    case 0x82: // Set high data bits, not wired
+      return available < 3 ? 0 : 3;
+    case 0x81: // Read low data bits
+      if (rxFree < 1) {
+        return 0;
+      }
+      pushRx(emu, emu->lowBits);
+      return 1;
+    case 0x83: // Read high data bits
+      if (rxFree < 1) {
+        return 0;
+      }
+      pushRx(emu, 0x00);
+      return 1;
+    case 0x84: // Loopback on
+      emu->loopback = 1;
+      return 1;
+    case 0x85: // Loopback off
+      emu->loopback = 0;
+      return 1;
+    case 0x86: // Clock divisor
+      if (available < 3) {
+        return 0;
+      }
+      emu->clockUs = (1 + (cmd[1] | (cmd[2] << 8))) * 2 / mpsseBaseClockMHz;
+      return 3;
+    case 0x87: // Send immediate
+    case 0x8A: // H type clock and phase settings
+    case 0x8B:
+    case 0x8C:
+    case 0x8D:
+    case 0x97:
+    case 0x98:
+      return 1;
+    default:
+      if (rxFree < 2) {
+        return 0;
+      }
+      badCommand(emu, opcode);
+      return 1;
+  }
+}
+
+void runCommands(Emulator *emu) {
+  int pos = 0;
+  while (pos < emu->cmdsLength) {
+    const int ret = runCommand(emu, emu->cmds + pos, emu->cmdsLength - pos);
+    if (ret == 0) {
+      break;
+    }
+    pos += ret;
+  }
+
+  emu->cmdsLength -= pos;
+  memmove(emu->cmds, emu->cmds + pos, emu->cmdsLength);
+}
+
+// Transport backend
+//------------------------------
+
+int emulatorSetup(UsbTransport *t) {
+  auto emu = (Emulator *)t->backend;
+  emu->cmdsLength = 0;
+  emu->rxCount = 0;
+  return 0;
+}
+
+void *emulatorSubmitWrite(UsbTransport *t, uint8_t *data, int nBytes) {
+  auto emu = (Emulator *)t->backend;
+  const double now = emulatorNow(emu);
+
+  emu->usbWrites++;
+  emu->cmdBytes += nBytes;
+
+  // Transfers share the link, each one arrives a latency after it was sent
+  if (emu->linkFreeUs < now) {
+    emu->linkFreeUs = now;
+  }
+  emu->linkFreeUs += nBytes / emu->bytesPerUs;
+  const double arrivalUs = emu->linkFreeUs + emu->latencyUs;
+
+  if (emu->cmdsLength + nBytes > emu->cmdsCapacity) {
+    emu->cmdsCapacity = (emu->cmdsLength + nBytes) * 2;
+    emu->cmds = (uint8_t *)realloc(emu->cmds, emu->cmdsCapacity);
+  }
+  memcpy(emu->cmds + emu->cmdsLength, data, nBytes);
+  emu->cmdsLength += nBytes;
+
+  if (emu->deviceUs < arrivalUs) {
+    emu->deviceUs = arrivalUs;
+  }
+  runCommands(emu);
+
+  // The chip only takes more data as fast as the MPSSE runs it
+  auto transfer = new EmulatedTransfer;
+  transfer->doneUs = emu->deviceUs > arrivalUs ? emu->deviceUs : arrivalUs;
+  return transfer;
+}
+
+int emulatorWaitWrite(UsbTransport *t, void *transfer) {
+  auto emu = (Emulator *)t->backend;
+  auto et = (EmulatedTransfer *)transfer;
+
+  emulatorWaitUntil(emu, et->doneUs);
+  delete et;
+
+  // More than the chip buffer left means the USB write would never finish
+  if (emu->cmdsLength > emulatedTxBufferSize) {
+    logMessage(LOG_ERROR,
+               "Unable to write data to device: emulated MPSSE stalled with "
+               "%d answer bytes unread",
+               emu->rxCount);
+    return -1;
+  }
+  return 0;
+}
+
+void emulatorCancelWrite(UsbTransport *, void *transfer) {
+  delete (EmulatedTransfer *)transfer;
+}
+
+int emulatorRead(UsbTransport *t, uint8_t *dst, int nBytes) {
+  auto emu = (Emulator *)t->backend;
+  int received = 0;
+  double lastUs = 0; // When the last answer read was ready
+
+  emu->usbReads++;
+  while (received < nBytes) {
+    runCommands(emu);
+    if (emu->rxCount == 0) {
+      logMessage(LOG_ERROR,
+                 "Short read: %d of %d bytes from emulator",
+                 received,
+                 nBytes);
+      return -1;
+    }
+
+    while (received < nBytes && emu->rxCount > 0) {
+      dst[received++] = emu->rx[emu->rxHead];
+      lastUs = emu->rxUs[emu->rxHead];
+      emu->rxHead = (emu->rxHead + 1) % emulatedRxBufferSize;
+      emu->rxCount--;
+    }
+  }
+
+  // Commands queued after the answers keep running meanwhile
+  const double now = emulatorNow(emu);
+  const double readyUs = lastUs > now ? lastUs : now;
+  emulatorWaitUntil(emu, readyUs + emu->latencyUs + nBytes / emu->bytesPerUs);
+  return nBytes;
+}
+
+int emulatorDrain(UsbTransport *t) {
+  auto emu = (Emulator *)t->backend;
+
+  runCommands(emu);
+  const int dropped = emu->rxCount;
+  emu->rxCount = 0;
+
+  emulatorWaitUntil(emu, emulatorNow(emu) + emu->latencyUs);
+  return dropped;
+}
+
+void emulatorClose(UsbTransport *t) {
+  auto emu = (Emulator *)t->backend;
+  const EmulatedFlash *flash = &emu->flash;
+
+  if (emu->image[0]) {
+    FILE *f = fopen(emu->image, "wb");
+    if (!f || fwrite(flash->mem, 1, flashSize, f) != (size_t)flashSize) {
+      logMessage(LOG_ERROR, "Unable to save emulator image %s", emu->image);
+    }
+    if (f) {
+      fclose(f);
+    }
+  }
+
+  logMessage(LOG_INFO,
+             "Emulator: %lld command bytes in %lld writes, %lld reads, "
+             "%lld programs, %lld erases, %lld status reads, "
+             "%lld cycles ignored while busy",
+             (long long)emu->cmdBytes,
+             (long long)emu->usbWrites,
+             (long long)emu->usbReads,
+             (long long)flash->programs,
+             (long long)flash->erases,
+             (long long)flash->busyReads,
+             (long long)flash->ignoredWrites);
+
+  free(emu->cmds);
+  delete emu;
+}
+
+const TransportOps emulatorOps = {emulatorSetup,
+                                  emulatorSubmitWrite,
+                                  emulatorWaitWrite,
+                                  emulatorCancelWrite,
+                                  emulatorRead,
+                                  emulatorDrain,
+                                  emulatorClose};
+
+int emulatorStats(const UsbTransport *t, EmulatorStats *stats) {
+  if (t->ops != &emulatorOps) {
+    return -1;
+  }
+
+  auto emu = (Emulator *)t->backend;
+  const double now = emulatorNow(emu);
+  const double endUs = emu->deviceUs > now ? emu->deviceUs : now;
+
+  stats->cmdBytes = emu->cmdBytes;
+  stats->usbWrites = emu->usbWrites;
+  stats->usbReads = emu->usbReads;
+  stats->programs = emu->flash.programs;
+  stats->erases = emu->flash.erases;
+  stats->elapsedUs = endUs - emu->openUs;
+  return 0;
+}
+
+int isEmulatorDevice(const char *device) {
+  return device && strncmp(device, "emu", 3) == 0 &&
+         (device[3] == 0 || device[3] == ':');
+}
+
+// Parses "key=value,..." into emu
+int parseEmulatorOptions(Emulator *emu, const char *options) {
+  char buffer[1024];
+  char *save;
+
+  snprintf(buffer, sizeof(buffer), "%s", options);
+  for (char *option = strtok_r(buffer, ",", &save); option;
+       option = strtok_r(nullptr, ",", &save)) {
+    char *value = strchr(option, '=');
+    if (!value) {
+      logMessage(LOG_ERROR, "Emulator option %s needs a value", option);
+      return -1;
+    }
+    *value++ = 0;
+
+    if (strcmp(option, "latency") == 0) {
+      emu->latencyUs = atof(value);
+    } else if (strcmp(option, "bandwidth") == 0) {
+      emu->bytesPerUs = atof(value) / 1e6;
+    } else if (strcmp(option, "erase") == 0) {
+      emu->flash.blockEraseUs = atoi(value);
+    } else if (strcmp(option, "program") == 0) {
+      emu->flash.programUs = atoi(value);
+    } else if (strcmp(option, "chip") == 0) {
+      emu->flash.chip = nullptr;
+      for (const EmulatedChip &chip : emulatedChips) {
+        if (strcmp(value, chip.name) == 0) {
+          emu->flash.chip = &chip;
+        }
+      }
+      if (!emu->flash.chip) {
+        logMessage(LOG_ERROR, "Unknown emulated chip %s", value);
+        return -1;
+      }
+    } else if (strcmp(option, "image") == 0) {
+      snprintf(emu->image, sizeof(emu->image), "%s", value);
+    } else if (strcmp(option, "realtime") == 0) {
+      emu->realtime = atoi(value) != 0;
+    } else {
+      logMessage(LOG_ERROR, "Unknown emulator option %s", option);
+      return -1;
+    }
+  }
+
+  if (emu->bytesPerUs <= 0) {
+    logMessage(LOG_ERROR, "Emulator bandwidth must be positive");
+    return -1;
+  }
+  return 0;
+}
+
+int emulatorOpen(UsbTransport *t, const char *device) {
+  auto emu = new Emulator();
+  EmulatedFlash *flash = &emu->flash;
+
+  memset(flash->mem, erasedByte, flashSize);
+  flash->cycle = CYCLE_IDLE;
+  flash->mode = FLASH_READ;
+  flash->chip = &emulatedChips[0];
+  flash->programUs = defaultProgramUs;
+  flash->bufferProgramUs = defaultBufferProgramUs;
+  flash->blockEraseUs = defaultBlockEraseUs;
+  flash->sectorEraseUs = defaultSectorEraseUs;
+  flash->chipEraseUs = defaultChipEraseUs;
+
+  emu->clockUs = 2 / mpsseBaseClockMHz;
+  emu->realtime = 1;
+  emu->latencyUs = 125;
+  emu->bytesPerUs = 30;
+
+  if (device[3] == ':' && parseEmulatorOptions(emu, device + 4) < 0) {
+    delete emu;
+    return -1;
+  }
+
+  if (emu->image[0]) {
+    FILE *f = fopen(emu->image, "rb");
+    if (f) {
+      fread(flash->mem, 1, flashSize, f);
+      fclose(f);
+    }
+  }
+
+  emu->openUs = emulatorNow(emu);
+  emu->deviceUs = emu->openUs;
+  emu->linkFreeUs = emu->openUs;
+
+  t->ops = &emulatorOps;
+  t->backend = emu;
+  snprintf(t->serial, sizeof(t->serial), "EMULATOR");
+  t->chipType = TYPE_2232H;
+  t->maxPacketSize = emulatedPacketSize;
+  t->rxBufferSize = emulatedRxBufferSize;
+  return 0;
+}
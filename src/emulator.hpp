@@ -0,0 +1,60 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef EMULATOR_HPP
+#define EMULATOR_HPP
+
+#include "transport.hpp"
+
+// Software programmer for tests and benchmarks. It runs the MPSSE commands
+// hm05 sends on an emulated FT2232H, shifts them through the cart's 32 clock
+// address/data protocol and into a flash chip model with chip Id, CFI, erase
+// and program semantics.
+//
+// Selected with device "emu", options go after a colon:
+// "emu:latency=125,bandwidth=30000000"
+//   latency=US     USB latency per transfer (default 125)
+//   bandwidth=B    USB payload bytes per second (default 30000000)
+//   erase=US       Block erase time (default 25000)
+//   program=US     Byte program time (default 7)
+//   chip=NAME      Flash chip model: sst39vf1681 (default), s29al016 with
+//                  unlock bypass, or amd-buffer, an AMD style chip with a
+//                  32 byte write buffer and an Id no driver lists
+//   image=PATH     Flash contents, loaded on open and saved on close
+//   realtime=0     Only account emulated time instead of waiting for it
+
+struct EmulatorStats {
+  int64_t cmdBytes;  // Bytes sent to the MPSSE
+  int64_t usbWrites; // Write transfers
+  int64_t usbReads;  // Read transfers
+  int64_t programs;
+  int64_t erases;
+  double elapsedUs; // Emulated time since the device was opened
+};
+
+int isEmulatorDevice(const char *device);
+int emulatorOpen(UsbTransport *t, const char *device);
+
+// Fills stats if t runs on the emulator. Returns -1 otherwise.
+int emulatorStats(const UsbTransport *t, EmulatorStats *stats);
+
+#endif
@@ -0,0 +1,365 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "encoder.hpp"
+#include <cassert>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// A read cycle whose data is not clocked in. Keeps the record framing while
+// giving the chip time to finish programming.
+alignas(32) constexpr uint8_t idleTemplate[16] = {0x11, 0x03, 0x00};
+
+// Address shift followed by the data phase, MSB or LSB first
+alignas(32) constexpr uint8_t readTemplates[2][16] = {
+  {0x11, 0x02, 0x00, 0x00, 0x00, 0x00, 0x24, 0x00, 0x00},
+  {0x11, 0x02, 0x00, 0x00, 0x00, 0x00, 0x2C, 0x00, 0x00},
+};
+
+inline void store16(uint8_t *dst, const uint8_t *src, int simd) {
+#if defined(__SSE2__)
+  if (simd) {
+    _mm_storeu_si128((__m128i *)dst, _mm_load_si128((const __m128i *)src));
+    return;
+  }
+#endif
+  (void)simd;
+  memcpy(dst, src, 16);
+}
+
+inline void store32(uint8_t *dst, const uint8_t *src, int simd) {
+#if defined(__AVX2__)
+  if (simd) {
+    _mm256_storeu_si256((__m256i *)dst,
+                        _mm256_load_si256((const __m256i *)src));
+    return;
+  }
+#endif
+  store16(dst, src, simd);
+  store16(dst + 16, src + 16, simd);
+}
+
+inline void patchAddress(uint8_t *dst, int addr, uint8_t writeFlag) {
+  dst[0] = ((addr >> 16) & 0x1F) | writeFlag;
+  dst[1] = (addr >> 8) & 0xFF;
+  dst[2] = addr & 0xFF;
+}
+
+// Same record layout enqueueFlashOut() produces:
+//    2 1111 1111 1100 000000000   0000 0000
+//    0 9876 5432 1098 7654 3210   7654 3210
+// CxxA AAAA AAAA AAAA AAAA AAAA | DDDD DDDD
+inline uint8_t *putWriteRecord(uint8_t *dst, int addr, uint8_t data) {
+  memcpy(dst, idleTemplate, 3);
+  patchAddress(dst + 3, addr, 0x80);
+  dst[6] = data;
+  return dst + flashOutRecordSize;
+}
+
+void makeProgramTemplate(ProgramTemplate *t,
+                         int unlockAddr1,
+                         int unlockAddr2,
+                         uint8_t programCommand,
+                         uint8_t unlockBypass) {
+  uint8_t *dst = t->data;
+
+  memset(t->data, 0, sizeof(t->data));
+  if (!unlockBypass) {
+    dst = putWriteRecord(dst, unlockAddr1, 0xAA);
+    dst = putWriteRecord(dst, unlockAddr2, 0x55);
+  }
+  dst = putWriteRecord(dst, unlockAddr1, programCommand);
+
+  // Header of the data record, its address and data are patched per byte
+  memcpy(dst, idleTemplate, 3);
+  t->records = (dst - t->data) / flashOutRecordSize + 1;
+}
+
+// The scalar and SIMD encoders only differ in how templates are copied.
+// Whole templates (slack included) are stored, later records overwrite it.
+inline int encodeProgram(CommandBuffer *cb,
+                         const ProgramTemplate *t,
+                         int addr,
+                         const uint8_t *src,
+                         int nBytes,
+                         int paddingRecords,
+                         int simd) {
+  assert(cb->pos + programRecordsSize(t, nBytes, paddingRecords) <=
+         cb->capacity);
+
+  const int templateSize = t->records * flashOutRecordSize;
+  uint8_t *dst = cb->data + cb->pos;
+  int skipped = 0;
+
+  for (int i = 0; i < nBytes; i++) {
+    if (src[i] == erasedByte) {
+      skipped++;
+      continue;
+    }
+
+    store32(dst, t->data, simd);
+    patchAddress(dst + templateSize - 4, addr + i, 0x80);
+    dst[templateSize - 1] = reverseByte(src[i]);
+    dst += templateSize;
+
+    for (int j = 0; j < paddingRecords; j++) {
+      store16(dst, idleTemplate, simd);
+      patchAddress(dst + 3, addr + i, 0x00);
+      dst += flashOutRecordSize;
+    }
+  }
+
+  cb->pos = dst - cb->data;
+  return skipped;
+}
+
+int encodeBufferProgramRecords(CommandBuffer *cb,
+                               const BufferProgram *bp,
+                               int addr,
+                               const uint8_t *src,
+                               int nBytes) {
+  assert(cb->pos + bufferProgramRecordsSize(nBytes, bp) <= cb->capacity);
+
+  uint8_t *dst = cb->data + cb->pos;
+  int skipped = 0;
+
+  for (int offset = 0; offset < nBytes;) {
+    const int page = (addr + offset) & ~(bp->bufferBytes - 1);
+    const int pageEnd = page + bp->bufferBytes - addr;
+    const int end = pageEnd < nBytes ? pageEnd : nBytes;
+
+    int count = 0;
+    for (int i = offset; i < end; i++) {
+      count += src[i] != erasedByte;
+    }
+    skipped += end - offset - count;
+    if (count == 0) {
+      offset = end;
+      continue;
+    }
+
+    dst = putWriteRecord(dst, bp->unlockAddr1, 0xAA);
+    dst = putWriteRecord(dst, bp->unlockAddr2, 0x55);
+    dst = putWriteRecord(dst, page, bp->command);
+    dst = putWriteRecord(dst, page, count - 1);
+    for (int i = offset; i < end; i++) {
+      if (src[i] != erasedByte) {
+        dst = putWriteRecord(dst, addr + i, reverseByte(src[i]));
+      }
+    }
+    dst = putWriteRecord(dst, page, bp->confirmCommand);
+
+    for (int j = 0; j < bp->paddingRecords; j++) {
+      memcpy(dst, idleTemplate, flashOutRecordSize);
+      patchAddress(dst + 3, page, 0x00);
+      dst += flashOutRecordSize;
+    }
+    offset = end;
+  }
+
+  cb->pos = dst - cb->data;
+  return skipped;
+}
+
+// Bytes the MPSSE command at cmd takes, or -1 if the opcode is not one hm05
+// sends or the command is cut short
+int mpsseCommandSize(const uint8_t *cmd, int available) {
+  switch (cmd[0]) {
+    case 0x11: // Clock data bytes out, and in with 0x31 and 0x39
+    case 0x31:
+    case 0x39:
+      return available < 3 ? -1 : 3 + (cmd[1] | (cmd[2] << 8)) + 1;
+    case 0x24: // Clock data bytes in, MSB or LSB first
+    case 0x2C:
+    case 0x80: // Set data bits, low and high bytes
+    case 0x82:
+    case 0x86: // Clock divisor
+      return 3;
+    case 0x81: // Read data bits, low and high bytes
+    case 0x83:
+    case 0x84: // Loopback on and off
+    case 0x85:
+    case 0x87: // Send immediate
+      return 1;
+    default:
+      return -1;
+  }
+}
+
+void coalesceClockOut(CommandBuffer *cb, int from) {
+  uint8_t *data = cb->data;
+  int in = from;
+  int out = from;
+  int run = -1; // Header of the clock out command being extended, or -1
+
+  while (in < cb->pos) {
+    const int size = mpsseCommandSize(data + in, cb->pos - in);
+    if (size < 0 || in + size > cb->pos) {
+      memmove(data + out, data + in, cb->pos - in);
+      out += cb->pos - in;
+      break;
+    }
+
+    if (data[in] == 0x11 && run >= 0) {
+      const int runLength = (data[run + 1] | (data[run + 2] << 8)) + 1;
+      const int length = size - 3;
+      if (runLength + length <= maxShiftLength) {
+        memmove(data + out, data + in + 3, length);
+        out += length;
+        in += size;
+        data[run + 1] = (runLength + length - 1) & 0xFF;
+        data[run + 2] = (runLength + length - 1) >> 8;
+        continue;
+      }
+    }
+
+    run = data[in] == 0x11 ? out : -1;
+    memmove(data + out, data + in, size);
+    out += size;
+    in += size;
+  }
+
+  cb->pos = out;
+}
+
+void encodeDuplexReadRecords(CommandBuffer *cb,
+                             int addr,
+                             int nBytes,
+                             uint8_t lsbFirst) {
+  assert(cb->pos + duplexReadRecordsSize(nBytes) <= cb->capacity);
+
+  const int recordsPerShift = maxShiftLength / duplexReadRecordSize;
+  uint8_t *dst = cb->data + cb->pos;
+  int records = nBytes + 1;
+
+  while (records > 0) {
+    const int n = records > recordsPerShift ? recordsPerShift : records;
+    const int length = n * duplexReadRecordSize;
+
+    // Clock Data Bytes In and Out, out on -ve and in on +ve clock edge, MSB
+    // or LSB first
+    dst[0] = lsbFirst ? 0x39 : 0x31;
+    dst[1] = (length - 1) & 0xFF;
+    dst[2] = (length - 1) >> 8;
+    dst += 3;
+
+    for (int i = 0; i < n; i++) {
+      patchAddress(dst, addr++, 0x00);
+      if (lsbFirst) {
+        dst[0] = reverseByte(dst[0]);
+        dst[1] = reverseByte(dst[1]);
+        dst[2] = reverseByte(dst[2]);
+      }
+      dst[3] = 0x00;
+      dst += duplexReadRecordSize;
+    }
+    records -= n;
+  }
+
+  cb->pos = dst - cb->data;
+}
+
+void pickDuplexReadData(uint8_t *dst,
+                        const uint8_t *answers,
+                        int nBytes,
+                        int dataBit,
+                        uint8_t lsbFirst) {
+  assert(dataBit >= 16 && dataBit <= 32);
+
+  // The byte is somewhere in the last 2 bytes of its record and the first one
+  // of the next
+  const uint8_t *src = answers + 2;
+  if (lsbFirst) {
+    // Each answer byte holds its first bit clocked in as the LSB, so the
+    // window runs little endian and the data comes out reversed
+    const int shift = dataBit - 16;
+    for (int i = 0; i < nBytes; i++) {
+      const uint32_t window = src[0] | (src[1] << 8) | (src[2] << 16);
+      dst[i] = (window >> shift) & 0xFF;
+      src += duplexReadRecordSize;
+    }
+    return;
+  }
+
+  const int shift = 32 - dataBit;
+  for (int i = 0; i < nBytes; i++) {
+    const uint32_t window = (src[0] << 16) | (src[1] << 8) | src[2];
+    dst[i] = (window >> shift) & 0xFF;
+    src += duplexReadRecordSize;
+  }
+}
+
+inline void encodeRead(CommandBuffer *cb,
+                       int addr,
+                       int nBytes,
+                       uint8_t lsbFirst,
+                       int simd) {
+  assert(cb->pos + readRecordsSize(nBytes) <= cb->capacity);
+
+  const uint8_t *readTemplate = readTemplates[lsbFirst ? 1 : 0];
+  uint8_t *dst = cb->data + cb->pos;
+
+  for (int i = 0; i < nBytes; i++) {
+    store16(dst, readTemplate, simd);
+    patchAddress(dst + 3, addr + i, 0x00);
+    dst += readRecordSize;
+  }
+
+  cb->pos = dst - cb->data;
+}
+
+int encodeProgramRecords(CommandBuffer *cb,
+                         const ProgramTemplate *t,
+                         int addr,
+                         const uint8_t *src,
+                         int nBytes,
+                         int paddingRecords) {
+  return encodeProgram(cb, t, addr, src, nBytes, paddingRecords, 1);
+}
+
+void encodeReadRecords(CommandBuffer *cb,
+                       int addr,
+                       int nBytes,
+                       uint8_t lsbFirst) {
+  encodeRead(cb, addr, nBytes, lsbFirst, 1);
+}
+
+int encodeProgramRecordsScalar(CommandBuffer *cb,
+                               const ProgramTemplate *t,
+                               int addr,
+                               const uint8_t *src,
+                               int nBytes,
+                               int paddingRecords) {
+  return encodeProgram(cb, t, addr, src, nBytes, paddingRecords, 0);
+}
+
+void encodeReadRecordsScalar(CommandBuffer *cb,
+                             int addr,
+                             int nBytes,
+                             uint8_t lsbFirst) {
+  encodeRead(cb, addr, nBytes, lsbFirst, 0);
+}
@@ -0,0 +1,177 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef ENCODER_HPP
+#define ENCODER_HPP
+
+#include <cstdint>
+
+struct CommandBuffer {
+  uint8_t *data;
+  int pos;
+  int capacity;
+};
+
+// Value of an erased flash byte. Programming it is a no-op.
+const uint8_t erasedByte = 0xFF;
+// Bytes sent per address/data record
+const int flashOutRecordSize = 7;
+// Bytes sent per read record
+const int readRecordSize = 9;
+// Bytes clocked out and in per full-duplex read record
+const int duplexReadRecordSize = 4;
+// Longest data shifting command, its length field holds length - 1
+const int maxShiftLength = 65536;
+// Encoders may store up to this many bytes past the last record
+const int encoderSlack = 32;
+
+// 64-bits systems only
+inline uint8_t reverseByte(uint8_t b) {
+  return (b * 0x0202020202ULL & 0x010884422010ULL) % 1023;
+}
+
+// Command cycles and the header of the data record preceding every
+// programmed byte, see makeProgramTemplate()
+struct ProgramTemplate {
+  alignas(32) uint8_t data[32];
+  int records; // Records per programmed byte, the data record included
+};
+
+// Fills t with the unlock cycles (0xAA at unlockAddr1, 0x55 at unlockAddr2)
+// and the program command written to unlockAddr1. In unlock bypass mode only
+// the program command is left.
+void makeProgramTemplate(ProgramTemplate *t,
+                         int unlockAddr1,
+                         int unlockAddr2,
+                         uint8_t programCommand,
+                         uint8_t unlockBypass);
+
+// Write buffer programming. Every page of bufferBytes takes the unlock
+// cycles, the command and the byte count - 1 at the page, one record per
+// byte and the confirm command, followed by paddingRecords idle records.
+struct BufferProgram {
+  int unlockAddr1;
+  int unlockAddr2;
+  uint8_t command;        // Write to buffer
+  uint8_t confirmCommand; // Program buffer to flash
+  int bufferBytes;        // Power of two
+  int paddingRecords;
+};
+
+// Records per page besides the data records
+const int bufferCommandRecords = 5;
+
+// Worst case buffer size for encodeProgramRecords()
+inline int programRecordsSize(const ProgramTemplate *t,
+                              int nBytes,
+                              int paddingRecords) {
+  return nBytes * (t->records + paddingRecords) * flashOutRecordSize +
+         encoderSlack;
+}
+
+// Worst case buffer size for encodeBufferProgramRecords()
+inline int bufferProgramRecordsSize(int nBytes, const BufferProgram *bp) {
+  const int pages = nBytes / bp->bufferBytes + 2;
+  return (pages * (bufferCommandRecords + bp->paddingRecords) + nBytes) *
+           flashOutRecordSize +
+         encoderSlack;
+}
+
+// Worst case buffer size for encodeReadRecords()
+inline int readRecordsSize(int nBytes) {
+  return nBytes * readRecordSize + encoderSlack;
+}
+
+// Worst case buffer size for encodeDuplexReadRecords()
+inline int duplexReadRecordsSize(int nBytes) {
+  const int records = nBytes + 1;
+  return records * duplexReadRecordSize +
+         (records * duplexReadRecordSize / maxShiftLength + 1) * 3 +
+         encoderSlack;
+}
+
+// Appends the program commands for nBytes of src at addr, followed by
+// paddingRecords idle records each. Erased-value bytes are left out.
+// Returns the number of bytes left out.
+int encodeProgramRecords(CommandBuffer *cb,
+                         const ProgramTemplate *t,
+                         int addr,
+                         const uint8_t *src,
+                         int nBytes,
+                         int paddingRecords);
+
+// Same as encodeProgramRecords() through the write buffer. Pages only holding
+// erased-value bytes are left out.
+int encodeBufferProgramRecords(CommandBuffer *cb,
+                               const BufferProgram *bp,
+                               int addr,
+                               const uint8_t *src,
+                               int nBytes);
+
+// Appends read records for nBytes consecutive addresses starting at addr
+void encodeReadRecords(CommandBuffer *cb,
+                       int addr,
+                       int nBytes,
+                       uint8_t lsbFirst);
+
+// Appends clock data bytes in and out commands (0x31, one per 64 KiB)
+// shifting a 4 byte record per address: the 3 address bytes and a filler
+// byte. The address of a record goes out while the data of the previous one
+// comes in. One extra record follows the last address so skewed answers still
+// hold the whole last byte, see pickDuplexReadData(). With lsbFirst the
+// commands shift LSB first (0x39) and the address bytes go out pre-reversed,
+// so the same bits reach the cart while the answers come in bit reversed.
+void encodeDuplexReadRecords(CommandBuffer *cb,
+                             int addr,
+                             int nBytes,
+                             uint8_t lsbFirst);
+
+// Extracts nBytes of data from the answers to encodeDuplexReadRecords(). The
+// MSB of each byte was clocked in at bit dataBit of its record, 16 to 32, 24
+// when the answers are aligned with the records. LSB first answers give the
+// bytes bit reversed, as the flash holds them, at any dataBit.
+void pickDuplexReadData(uint8_t *dst,
+                        const uint8_t *answers,
+                        int nBytes,
+                        int dataBit,
+                        uint8_t lsbFirst);
+
+// Merges the runs of adjacent clock data bytes out commands (0x11) from
+// offset from on into single commands of up to 64 KiB, dropping their 3 byte
+// headers. The same bits get clocked out. Commands after the first opcode it
+// doesn't know the length of are left as they are.
+void coalesceClockOut(CommandBuffer *cb, int from);
+
+// Portable versions, always built. The ones above use SIMD stores when the
+// compiler targets SSE2 or AVX2 and produce the same bytes.
+int encodeProgramRecordsScalar(CommandBuffer *cb,
+                               const ProgramTemplate *t,
+                               int addr,
+                               const uint8_t *src,
+                               int nBytes,
+                               int paddingRecords);
+void encodeReadRecordsScalar(CommandBuffer *cb,
+                             int addr,
+                             int nBytes,
+                             uint8_t lsbFirst);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "flash_driver.hpp"
+
+namespace {
+
+// Chip specific entries go first, the command set fallbacks last
+const FlashDriver flashDrivers[] = {
+  // 4 KiB sectors and 64 KiB blocks over the whole chip. TBP is 10 us max
+  // while the CFI typical time says 16 us.
+  {"SST39VF1681", 0xBF, 0xC8, 0x0701, 0xAAA, 0x555, 0xA0, 0x30, 0x50, 0x10,
+   0, 0, 10},
+  {"SST39VF1682", 0xBF, 0xC9, 0x0701, 0xAAA, 0x555, 0xA0, 0x30, 0x50, 0x10,
+   0, 0, 10},
+  // Top and bottom boot versions in byte mode, with unlock bypass
+  {"S29AL016", 0x01, 0xC4, 0x0002, 0xAAA, 0x555, 0xA0, 0x30, 0, 0x10, 1, 0, 0},
+  {"S29AL016", 0x01, 0x49, 0x0002, 0xAAA, 0x555, 0xA0, 0x30, 0, 0x10, 1, 0, 0},
+  {"MX29LV160", 0xC2, 0xC4, 0x0002, 0xAAA, 0x555, 0xA0, 0x30, 0, 0x10, 1, 0, 0},
+  {"MX29LV160", 0xC2, 0x49, 0x0002, 0xAAA, 0x555, 0xA0, 0x30, 0, 0x10, 1, 0, 0},
+  // Byte mode unlock addresses, the erase command works on the CFI region
+  // blocks. Program times and write buffer sizes come from CFI.
+  {"AMD/Fujitsu standard", 0, 0, 0x0002, 0xAAA, 0x555, 0xA0, 0x30, 0, 0x10,
+   0, 0x25, 0},
+  {"AMD/Fujitsu extended", 0, 0, 0x0004, 0xAAA, 0x555, 0xA0, 0x30, 0, 0x10,
+   0, 0x25, 0},
+};
+
+const int numFlashDrivers = sizeof(flashDrivers) / sizeof(flashDrivers[0]);
+
+} // namespace
+
+// AMD/Fujitsu standard, the first of the two fallbacks
+const FlashDriver *const jedecFlashDriver = &flashDrivers[numFlashDrivers - 2];
+
+const FlashDriver *findFlashDriver(uint8_t manufacturerId,
+                                   uint8_t deviceId,
+                                   uint16_t controlInterfaceId) {
+  for (int i = 0; i < numFlashDrivers; i++) {
+    const FlashDriver *driver = &flashDrivers[i];
+    if (driver->manufacturerId && driver->manufacturerId == manufacturerId &&
+        driver->deviceId == deviceId) {
+      return driver;
+    }
+  }
+
+  for (int i = 0; i < numFlashDrivers; i++) {
+    const FlashDriver *driver = &flashDrivers[i];
+    if (!driver->manufacturerId &&
+        driver->controlInterfaceId == controlInterfaceId) {
+      return driver;
+    }
+  }
+  return nullptr;
+}
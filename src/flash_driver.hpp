@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef FLASH_DRIVER_HPP
+#define FLASH_DRIVER_HPP
+
+#include <cstdint>
+
+// Command set of a family of flash chips. Every command starts with the two
+// unlock cycles, 0xAA at unlockAddr1 and 0x55 at unlockAddr2, followed by
+// the command byte at unlockAddr1. Erases repeat the unlock cycles after the
+// 0x80 erase setup and write their command byte at the erased address.
+struct FlashDriver {
+  const char *name;
+  uint8_t manufacturerId; // JEDEC Ids, both 0 to match by command set only
+  uint8_t deviceId;
+  uint16_t controlInterfaceId; // CFI command set (See JEP137)
+  int unlockAddr1;
+  int unlockAddr2;
+  uint8_t programCommand;
+  uint8_t blockEraseCommand;
+  uint8_t sectorEraseCommand; // 0 if blocks are the finest erase unit
+  uint8_t chipEraseCommand;   // 0 if unsupported
+  // 0x20 after the unlock cycles enters the unlock bypass mode, where a
+  // program takes the program command and the data cycle only
+  uint8_t unlockBypass;
+  // Loads up to the CFI multibyte program size into the write buffer, 0 if
+  // the command set has none
+  uint8_t writeBufferCommand;
+  // Worst case byte program time paced in the program stream, 0 to take the
+  // maximum the CFI typicalTimeouts[] give
+  int byteProgramUs;
+};
+
+// Command set used to read the chip Id and CFI data before a driver is known
+extern const FlashDriver *const jedecFlashDriver;
+
+// Returns the driver for the chip Id, falling back to the CFI command set,
+// or nullptr if the chip is not supported
+const FlashDriver *findFlashDriver(uint8_t manufacturerId,
+                                   uint8_t deviceId,
+                                   uint16_t controlInterfaceId);
+
+#endif
@@ -22,8 +22,26 @@ SOFTWARE.
 
 #include <cstdio>
 #include <cstdarg>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
 #include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "hm05.hpp"
+#include "trace.hpp"
 
 #define OPTPARSE_IMPLEMENTATION
 #define OPTPARSE_API static
@@ -31,14 +49,628 @@ SOFTWARE.
 
 const int logBufferLength = 5000;
 char logBuffer[logBufferLength];
+std::mutex logMutex;
+
+// Names the programmer a worker thread is driving, prefixed to its messages
+thread_local const char *logTag = nullptr;
+
+// Server connection of the job the thread runs, its messages also go there
+thread_local int logClient = -1;
+
+// Info messages move to stderr while a dump is written to stdout
+FILE *infoLog = stdout;
 
 void logMessage(int logLevel, const char *formatString, ...) {
+  std::lock_guard<std::mutex> lock(logMutex);
   va_list args;
   va_start(args, formatString);
   vsnprintf(logBuffer, logBufferLength, formatString, args);
   va_end(args);
-  fprintf(logLevel == LOG_ERROR ? stderr : stdout, "%s\n", logBuffer);
-  fflush(stdout);
+  FILE *out = logLevel == LOG_ERROR ? stderr : infoLog;
+  if (logTag) {
+    fprintf(out, "[%s] ", logTag);
+  }
+  fprintf(out, "%s\n", logBuffer);
+  fflush(infoLog);
+
+  if (logClient >= 0) {
+    char kind = logLevel == LOG_ERROR ? 'E' : 'I';
+    iovec parts[2] = {{&kind, 1}, {logBuffer, strlen(logBuffer)}};
+    msghdr msg = {};
+    msg.msg_iov = parts;
+    msg.msg_iovlen = 2;
+    // A client not reading must not hold every other thread here
+    sendmsg(logClient, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  }
+}
+
+LogContext getLogContext() {
+  return {logTag, logClient};
+}
+
+void setLogContext(LogContext context) {
+  logTag = context.tag;
+  logClient = context.client;
+}
+
+// Per-programmer cache files live in $XDG_CACHE_HOME/hm05 (~/.cache/hm05)
+int cacheFilePath(char *dst, int dstSize, const char *name) {
+  const char *cacheHome = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[1024];
+
+  if (cacheHome && cacheHome[0]) {
+    mkdir(cacheHome, 0755);
+    snprintf(dir, sizeof(dir), "%s/hm05", cacheHome);
+  } else if (home && home[0]) {
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+    mkdir(dir, 0755);
+    snprintf(dir, sizeof(dir), "%s/.cache/hm05", home);
+  } else {
+    return -1;
+  }
+
+  mkdir(dir, 0755);
+  snprintf(dst, dstSize, "%s/%s", dir, name);
+  return 0;
+}
+
+// Tuned read batch sizes, one "<serial> <bytes>" line per programmer
+const char *readBatchCacheName = "read_batch";
+std::mutex readBatchCacheMutex;
+
+int loadReadBatch(const char *serial) {
+  char path[1100];
+  char lineSerial[64];
+  int batch;
+  int found = 0;
+  std::lock_guard<std::mutex> lock(readBatchCacheMutex);
+
+  if (!serial[0] || cacheFilePath(path, sizeof(path), readBatchCacheName)) {
+    return 0;
+  }
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+  while (fscanf(f, "%63s %d", lineSerial, &batch) == 2) {
+    if (strcmp(lineSerial, serial) == 0) {
+      found = batch;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+void saveReadBatch(const char *serial, int batch) {
+  char path[1100];
+  char tmpPath[1110];
+  char lineSerial[64];
+  int lineBatch;
+  std::lock_guard<std::mutex> lock(readBatchCacheMutex);
+
+  if (!serial[0] || cacheFilePath(path, sizeof(path), readBatchCacheName)) {
+    return;
+  }
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+  FILE *out = fopen(tmpPath, "w");
+  if (!out) {
+    return;
+  }
+
+  // Keep every other programmer's entry
+  FILE *in = fopen(path, "r");
+  if (in) {
+    while (fscanf(in, "%63s %d", lineSerial, &lineBatch) == 2) {
+      if (strcmp(lineSerial, serial) != 0) {
+        fprintf(out, "%s %d\n", lineSerial, lineBatch);
+      }
+    }
+    fclose(in);
+  }
+
+  fprintf(out, "%s %d\n", serial, batch);
+  fclose(out);
+  rename(tmpPath, path);
+}
+
+// Cart manifests, one file per programmer and cart fingerprint. The header
+// line holds the block and sector geometry and the fingerprint, followed by
+// one "<sample hash>" line per block and one "<known> <hash>" line per sector.
+const char *manifestHeader = "hm05-manifest-2";
+
+int manifestPath(char *dst, int dstSize, const char *serial, uint32_t print) {
+  char name[128];
+  snprintf(name, sizeof(name), "manifest-%s-%08x", serial, print);
+  return cacheFilePath(dst, dstSize, name);
+}
+
+// Loads the sector hashes of the cart sampled into manifest. Returns the
+// number of known sectors, 0 if there is no manifest for it or it does not
+// match.
+int loadManifest(const char *serial, CartManifest *manifest) {
+  char path[1100];
+  char header[32];
+  int blockSize, numBlocks, sectorSize, numSectors, known;
+  unsigned int fingerprint, hash;
+  int knownSectors = 0;
+
+  if (manifestPath(path, sizeof(path), serial, manifest->fingerprint)) {
+    return 0;
+  }
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+
+  const int fields = fscanf(f,
+                            "%31s %d %d %d %d %x",
+                            header,
+                            &blockSize,
+                            &numBlocks,
+                            &sectorSize,
+                            &numSectors,
+                            &fingerprint);
+  if (fields != 6 || strcmp(header, manifestHeader) != 0 ||
+      blockSize != manifest->blockSize || numBlocks != manifest->numBlocks ||
+      sectorSize != manifest->sectorSize ||
+      numSectors != manifest->numSectors ||
+      fingerprint != manifest->fingerprint) {
+    fclose(f);
+    return 0;
+  }
+
+  // Every sample must still match, else the cart changed behind our back
+  CartManifest *loaded = new CartManifest(*manifest);
+  for (int i = 0; i < numBlocks && knownSectors >= 0; i++) {
+    if (fscanf(f, "%x", &hash) != 1 || hash != manifest->sampleHashes[i]) {
+      knownSectors = -1;
+    }
+  }
+  for (int i = 0; i < numSectors && knownSectors >= 0; i++) {
+    if (fscanf(f, "%d %x", &known, &hash) != 2) {
+      knownSectors = -1;
+      break;
+    }
+    loaded->known[i] = known != 0;
+    loaded->sectorHashes[i] = hash;
+    knownSectors += known != 0;
+  }
+  fclose(f);
+
+  if (knownSectors < 0) {
+    knownSectors = 0;
+  } else {
+    *manifest = *loaded;
+  }
+  delete loaded;
+  return knownSectors;
+}
+
+void saveManifest(const char *serial, const CartManifest *manifest) {
+  char path[1100];
+  char tmpPath[1110];
+
+  if (manifestPath(path, sizeof(path), serial, manifest->fingerprint)) {
+    return;
+  }
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+  FILE *f = fopen(tmpPath, "w");
+  if (!f) {
+    return;
+  }
+  fprintf(f,
+          "%s %d %d %d %d %08x\n",
+          manifestHeader,
+          manifest->blockSize,
+          manifest->numBlocks,
+          manifest->sectorSize,
+          manifest->numSectors,
+          manifest->fingerprint);
+  for (int i = 0; i < manifest->numBlocks; i++) {
+    fprintf(f, "%08x\n", manifest->sampleHashes[i]);
+  }
+  for (int i = 0; i < manifest->numSectors; i++) {
+    fprintf(f, "%d %08x\n", manifest->known[i], manifest->sectorHashes[i]);
+  }
+  if (fclose(f) == 0) {
+    rename(tmpPath, path);
+  }
+}
+
+void removeManifest(const char *serial, const CartManifest *manifest) {
+  char path[1100];
+  if (!manifestPath(path, sizeof(path), serial, manifest->fingerprint)) {
+    unlink(path);
+  }
+}
+
+// Images and dumps named *.gz are compressed
+int isGzipName(const char *filename) {
+  const size_t length = strlen(filename);
+  return length > 3 && strcmp(filename + length - 3, ".gz") == 0;
+}
+
+int isZstdName(const char *filename) {
+  const size_t length = strlen(filename);
+  return length > 4 && strcmp(filename + length - 4, ".zst") == 0;
+}
+
+// Decompresses a .gz image on its own thread while the cart is opened and
+// written. readImage() waits for the bytes it needs.
+struct ImageInflater {
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::thread thread;
+  gzFile gz;
+  int available; // Bytes decompressed so far
+  uint8_t failed;
+  uint8_t stop;
+};
+
+// Input image, mmap'ed so blocks go to the encoder without copies. Pipes
+// can't be mapped and are read into memory instead, as are .gz images.
+struct ImageFile {
+  const uint8_t *data;
+  int size;
+  uint8_t mapped;
+  ImageInflater *inflater; // Still decompressing data, or nullptr
+};
+
+// Reads the whole of fd, decompressing it through gz when not null
+int readImagePipe(int fd, gzFile gz, ImageFile *image) {
+  int capacity = 256 * 1024;
+  uint8_t *data = (uint8_t *)malloc(capacity);
+  int size = 0;
+  if (!data) {
+    return -1;
+  }
+
+  for (;;) {
+    if (size == capacity) {
+      // The byte past MAX_ROM_SIZE only tells oversized images apart
+      if (capacity > MAX_ROM_SIZE) {
+        logMessage(LOG_ERROR,
+                   "Image is bigger than the %d bytes a cart holds",
+                   MAX_ROM_SIZE);
+        free(data);
+        return -1;
+      }
+      capacity = capacity * 2 > MAX_ROM_SIZE ? MAX_ROM_SIZE + 1 : capacity * 2;
+      uint8_t *grown = (uint8_t *)realloc(data, capacity);
+      if (!grown) {
+        free(data);
+        return -1;
+      }
+      data = grown;
+    }
+    const ssize_t n = gz ? gzread(gz, data + size, capacity - size)
+                         : read(fd, data + size, capacity - size);
+    if (n < 0) {
+      free(data);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    size += n;
+  }
+
+  image->data = data;
+  image->size = size;
+  image->mapped = 0;
+  image->inflater = nullptr;
+  return 0;
+}
+
+void inflateStage(ImageFile *image) {
+  ImageInflater *inflater = image->inflater;
+  uint8_t *data = (uint8_t *)image->data;
+  const int chunkSize = 64 * 1024;
+  int size = 0;
+  int ok = 1;
+
+  while (ok && size < image->size) {
+    const int chunk =
+      image->size - size > chunkSize ? chunkSize : image->size - size;
+    ok = gzread(inflater->gz, data + size, chunk) == chunk;
+    size += ok ? chunk : 0;
+
+    std::lock_guard<std::mutex> lock(inflater->mutex);
+    inflater->available = size;
+    ok = ok && !inflater->stop;
+    inflater->cond.notify_all();
+  }
+
+  // Anything left means the trailer did not hold the size, as in several
+  // concatenated members
+  uint8_t extra;
+  if (ok && gzread(inflater->gz, &extra, 1) != 0) {
+    logMessage(LOG_ERROR, "Compressed image is not %d bytes", image->size);
+    ok = 0;
+  }
+  gzclose(inflater->gz);
+
+  std::lock_guard<std::mutex> lock(inflater->mutex);
+  inflater->failed = !ok;
+  inflater->cond.notify_all();
+}
+
+// Sizes the image after the gzip trailer (ISIZE, the size modulo 2^32) and
+// starts decompressing it. Takes fd.
+int openGzipImage(int fd, off_t fileSize, ImageFile *image) {
+  uint8_t magic[2];
+  uint8_t trailer[4];
+  if (fileSize < 18 || pread(fd, magic, 2, 0) != 2 || magic[0] != 0x1F ||
+      magic[1] != 0x8B || pread(fd, trailer, 4, fileSize - 4) != 4) {
+    close(fd);
+    return -1;
+  }
+  const uint32_t size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+                        ((uint32_t)trailer[3] << 24);
+  if (size > MAX_ROM_SIZE) {
+    logMessage(LOG_ERROR,
+               "Image is bigger than the %d bytes a cart holds",
+               MAX_ROM_SIZE);
+    close(fd);
+    return -1;
+  }
+
+  ImageInflater *inflater = new ImageInflater();
+  inflater->gz = gzdopen(fd, "rb");
+  if (!inflater->gz) {
+    close(fd);
+    delete inflater;
+    return -1;
+  }
+  gzbuffer(inflater->gz, 128 * 1024);
+
+  image->data = (const uint8_t *)malloc(size > 0 ? size : 1);
+  if (!image->data) {
+    gzclose(inflater->gz);
+    delete inflater;
+    return -1;
+  }
+  image->size = size;
+  image->mapped = 0;
+  image->inflater = inflater;
+  const LogContext logContext = getLogContext();
+  inflater->thread = std::thread([=] {
+    setLogContext(logContext);
+    inflateStage(image);
+  });
+  return 0;
+}
+
+// Takes fd, filename only tells .gz images apart
+int openImageFd(int fd, const char *filename, ImageFile *image) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  if (isGzipName(filename) && S_ISREG(st.st_mode)) {
+    return openGzipImage(fd, st.st_size, image);
+  }
+
+  if (!S_ISREG(st.st_mode)) {
+    gzFile gz = isGzipName(filename) ? gzdopen(fd, "rb") : nullptr;
+    const int ret = readImagePipe(fd, gz, image);
+    if (gz) {
+      gzclose(gz);
+    } else if (fd != 0) {
+      close(fd);
+    }
+    return ret;
+  }
+
+  if (st.st_size > INT32_MAX) {
+    close(fd);
+    return -1;
+  }
+
+  image->data = nullptr;
+  image->size = st.st_size;
+  image->mapped = 1;
+  image->inflater = nullptr;
+  if (image->size > 0) {
+    void *map = mmap(nullptr, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    madvise(map, image->size, MADV_SEQUENTIAL);
+    image->data = (const uint8_t *)map;
+  }
+
+  // The mapping stays valid after closing
+  close(fd);
+  return 0;
+}
+
+int openImage(const char *filename, ImageFile *image) {
+  const int fd = strcmp(filename, "-") == 0 ? 0 : open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  return openImageFd(fd, filename, image);
+}
+
+void closeImage(ImageFile *image) {
+  if (image->inflater) {
+    {
+      std::lock_guard<std::mutex> lock(image->inflater->mutex);
+      image->inflater->stop = 1;
+    }
+    image->inflater->thread.join();
+    delete image->inflater;
+  }
+  if (!image->data) {
+    return;
+  }
+  if (image->mapped) {
+    munmap((void *)image->data, image->size);
+  } else {
+    free((void *)image->data);
+  }
+}
+
+const uint8_t *readImage(void *user, int offset, int nBytes, uint8_t *) {
+  auto image = (const ImageFile *)user;
+  ImageInflater *inflater = image->inflater;
+
+  if (inflater) {
+    std::unique_lock<std::mutex> lock(inflater->mutex);
+    inflater->cond.wait(lock, [&] {
+      return inflater->failed || inflater->available >= offset + nBytes;
+    });
+    if (inflater->available < offset + nBytes) {
+      logMessage(LOG_ERROR, "Unable to decompress the image");
+      return nullptr;
+    }
+  }
+  return image->data + offset;
+}
+
+// Write-behind for dumps. readRom() blocks are queued and written by a
+// separate thread, so the next block is read while the previous one goes to
+// disk or down the pipe. Each block is flushed as soon as it is written.
+// .gz dumps are compressed there too, off the thread talking to the cart.
+const int writeBehindSlots = 4;
+
+struct WriteBehind {
+  std::mutex mutex;
+  std::condition_variable cond;
+  FILE *f;
+  gzFile gz; // Compressing to f, or nullptr
+  uint8_t *slots[writeBehindSlots];
+  int slotCapacities[writeBehindSlots];
+  int slotSizes[writeBehindSlots];
+  int64_t queued;
+  int64_t written;
+  uint8_t done;
+  uint8_t failed;
+};
+
+int writeDumpBlock(WriteBehind *wb, const uint8_t *data, int nBytes) {
+  if (wb->gz) {
+    return gzwrite(wb->gz, data, nBytes) == nBytes &&
+           gzflush(wb->gz, Z_SYNC_FLUSH) == Z_OK;
+  }
+  return fwrite(data, 1, nBytes, wb->f) == (size_t)nBytes &&
+         fflush(wb->f) == 0;
+}
+
+void writeBehindStage(WriteBehind *wb) {
+  std::unique_lock<std::mutex> lock(wb->mutex);
+
+  for (;;) {
+    wb->cond.wait(lock, [&] { return wb->done || wb->queued > wb->written; });
+    if (wb->queued == wb->written) {
+      return;
+    }
+
+    const int slot = wb->written % writeBehindSlots;
+    lock.unlock();
+
+    const int ok = writeDumpBlock(wb, wb->slots[slot], wb->slotSizes[slot]);
+
+    lock.lock();
+    wb->written++;
+    if (!ok) {
+      wb->failed = 1;
+    }
+    wb->cond.notify_all();
+  }
+}
+
+int writeBehindSink(void *user, const uint8_t *data, int nBytes) {
+  auto wb = (WriteBehind *)user;
+  std::unique_lock<std::mutex> lock(wb->mutex);
+  wb->cond.wait(lock, [&] {
+    return wb->failed || wb->queued - wb->written < writeBehindSlots;
+  });
+  if (wb->failed) {
+    return -1;
+  }
+
+  const int slot = wb->queued % writeBehindSlots;
+  lock.unlock();
+
+  if (wb->slotCapacities[slot] < nBytes) {
+    delete[] wb->slots[slot];
+    wb->slots[slot] = new uint8_t[nBytes];
+    wb->slotCapacities[slot] = nBytes;
+  }
+  memcpy(wb->slots[slot], data, nBytes);
+  wb->slotSizes[slot] = nBytes;
+
+  lock.lock();
+  wb->queued++;
+  wb->cond.notify_all();
+  return 0;
+}
+
+// Dumps the cart to f, gzip compressed if gzip is set. Returns the bytes read
+// or -1 on errors.
+int dumpRom(CartCommContext *ccc,
+            FILE *f,
+            int gzip,
+            const ReadRomOptions *options) {
+  WriteBehind wb;
+  wb.f = f;
+  wb.gz = nullptr;
+  if (gzip) {
+    // Owns a copy of the descriptor, so f can be closed as usual
+    wb.gz = gzdopen(dup(fileno(f)), "wb");
+    if (!wb.gz) {
+      logMessage(LOG_ERROR, "Unable to start compressing the ROM dump");
+      return -1;
+    }
+  }
+  wb.queued = 0;
+  wb.written = 0;
+  wb.done = 0;
+  wb.failed = 0;
+  for (int i = 0; i < writeBehindSlots; i++) {
+    wb.slots[i] = nullptr;
+    wb.slotCapacities[i] = 0;
+  }
+
+  const LogContext logContext = getLogContext();
+  std::thread writer([&] {
+    setLogContext(logContext);
+    writeBehindStage(&wb);
+  });
+
+  const RomSink sink = {writeBehindSink, &wb};
+  int ret = readRom(ccc, &sink, options);
+
+  {
+    std::lock_guard<std::mutex> lock(wb.mutex);
+    wb.done = 1;
+  }
+  wb.cond.notify_all();
+  writer.join();
+
+  for (int i = 0; i < writeBehindSlots; i++) {
+    delete[] wb.slots[i];
+  }
+
+  // Ends the gzip stream with its trailer
+  if (wb.gz && gzclose(wb.gz) != Z_OK) {
+    wb.failed = 1;
+  }
+
+  if (wb.failed) {
+    logMessage(LOG_ERROR, "Unable to write ROM dump");
+    ret = -1;
+  }
+  return ret;
 }
 
 void usageMessage(void) {
@@ -48,32 +680,508 @@ void usageMessage(void) {
          "\n"
          " hm05 write input-file         Write to cart input-file contents\n"
          "\n"
+         " hm05 verify input-file        Compare the cart against\n"
+         "                               input-file\n"
+         "\n"
+         " hm05 list                     List attached programmers\n"
+         "\n"
+         " hm05 serve socket             Keep the programmers open and run\n"
+         "                               the jobs sent with --server to\n"
+         "                               socket. The cart stays powered\n"
+         "                               and is identified again before\n"
+         "                               every job.\n"
+         "\n"
+         " Use - as file to read from stdin or write to stdout. Files\n"
+         " ending in .gz are decompressed or compressed on the fly.\n"
+         "\n"
+         " Write options: \n"
+         "  -d, --diff                   Only erase and write blocks that\n"
+         "                               differ from the cart contents\n"
+         "  -n, --no-manifest            Ignore the cart manifest saved by\n"
+         "                               the last write and rewrite every\n"
+         "                               block\n"
+         "\n"
+         " Read options: \n"
+         "  -s, --auto-size              Stop after the last block holding\n"
+         "                               data and trim trailing 0xFF bytes\n"
+         "\n"
+         " Range options: \n"
+         "  -o, --offset N               Write the file at cart address N,\n"
+         "                               keeping everything else, or start\n"
+         "                               the dump there\n"
+         "  -l, --length M               Only write the first M bytes of\n"
+         "                               the file, or dump M bytes\n"
+         "\n"
          " General options: \n"
-         "  -h, --help                   Print this help message\n");
+         "  -p, --programmer ID          Use the programmer with this serial\n"
+         "                               or BBB/DDD bus path, or emu[:opts]\n"
+         "                               for the emulator (see emulator.hpp)\n"
+         "  -a, --all                    Use every attached programmer at\n"
+         "                               once, dumps go to output-file.ID\n"
+         "  -S, --server SOCKET          Run the job on a hm05 serve\n"
+         "                               programmer, -p picks which one\n"
+         "  -q, --queue-depth N          USB transfers kept in flight\n"
+         "                               (default %d)\n"
+         "  -t, --tune                   Measure the best read batch size\n"
+         "                               again for this programmer\n"
+         "  -m, --metrics FILE           Write hot path metrics to FILE on\n"
+         "                               exit and on SIGUSR1, as JSON when\n"
+         "                               it ends in .json, else OpenMetrics\n"
+         "  -T, --trace FILE             Record USB transfers and flash\n"
+         "                               phases to FILE in Chrome trace\n"
+         "                               event format (for Perfetto)\n"
+         "  -h, --help                   Print this help message\n",
+         DEFAULT_USB_QUEUE_DEPTH);
 }
 
-CartCommContext ccc;
+const int maxProgrammers = 32;
 
-int main(int argc, char *argv[]) {
+//------------------------------------------------------------------------------
+// Metrics export
 
-  struct optparse_long longopts[] = {{"help", 'h', OPTPARSE_NONE}, {0}};
+// Metrics of every programmer used so far. Running jobs point into their
+// context, finished ones to a snapshot owned here.
+struct MetricsRegistry {
+  std::mutex mutex;
+  const char *path;
+  int count;
+  Metrics *metrics[maxProgrammers];
+  Metrics *snapshots[maxProgrammers];
+  char labels[maxProgrammers][64];
+};
+MetricsRegistry metricsRegistry;
 
-  char mode = 0; // r: read, w: write
+// Returns the registry slot for m, or -1 when metrics are off or full
+int registerMetrics(Metrics *m, const char *label) {
+  std::lock_guard<std::mutex> lock(metricsRegistry.mutex);
+  if (!metricsRegistry.path || metricsRegistry.count == maxProgrammers) {
+    return -1;
+  }
 
-  if (argc < 2) {
-    usageMessage();
-    return 0;
+  const int slot = metricsRegistry.count++;
+  metricsRegistry.metrics[slot] = m;
+  metricsRegistry.snapshots[slot] = nullptr;
+  snprintf(metricsRegistry.labels[slot],
+           sizeof(metricsRegistry.labels[slot]),
+           "%s",
+           label);
+  return slot;
+}
+
+// Keeps the final values of slot once its context goes away
+void unregisterMetrics(int slot) {
+  if (slot < 0) {
+    return;
   }
+  std::lock_guard<std::mutex> lock(metricsRegistry.mutex);
+  Metrics *snapshot = new Metrics();
+  metricsCopy(snapshot, metricsRegistry.metrics[slot]);
+  metricsRegistry.metrics[slot] = snapshot;
+  metricsRegistry.snapshots[slot] = snapshot;
+}
 
-  if (strcmp(argv[1], "write") == 0) {
-    mode = 'w';
+int writeMetrics() {
+  std::lock_guard<std::mutex> lock(metricsRegistry.mutex);
+  const char *path = metricsRegistry.path;
+  const char *labels[maxProgrammers];
+  for (int i = 0; i < metricsRegistry.count; i++) {
+    labels[i] = metricsRegistry.labels[i];
   }
-  if (strcmp(argv[1], "read") == 0) {
-    mode = 'r';
+
+  // Written aside and renamed so scrapers never see a partial file
+  char tmpPath[1100];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  FILE *f = fopen(tmpPath, "w");
+  if (!f) {
+    logMessage(LOG_ERROR, "Cannot open file %s for writing", tmpPath);
+    return -1;
   }
 
-  if (!mode) {
-    usageMessage();
+  const int pathLength = strlen(path);
+  if (pathLength > 5 && strcmp(path + pathLength - 5, ".json") == 0) {
+    writeMetricsJson(f, metricsRegistry.metrics, labels, metricsRegistry.count);
+  } else {
+    writeMetricsOpenMetrics(
+      f, metricsRegistry.metrics, labels, metricsRegistry.count);
+  }
+
+  if (fclose(f) != 0 || rename(tmpPath, path) != 0) {
+    logMessage(LOG_ERROR, "Unable to write metrics to %s", path);
+    return -1;
+  }
+  return 0;
+}
+
+void freeMetrics() {
+  std::lock_guard<std::mutex> lock(metricsRegistry.mutex);
+  for (int i = 0; i < metricsRegistry.count; i++) {
+    delete metricsRegistry.snapshots[i];
+  }
+  metricsRegistry.count = 0;
+}
+
+// SIGUSR1 is blocked in every thread and taken synchronously here, so the
+// dump runs outside signal context
+void startMetricsSignalThread() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  std::thread([set] {
+    int received;
+    while (sigwait(&set, &received) == 0) {
+      writeMetrics();
+    }
+  }).detach();
+}
+
+// What to do on every selected programmer
+struct Job {
+  char mode; // r: read, w: write, v: verify, s: serve
+  const char *filename;
+  int toStdio;
+  const ImageFile *image; // Shared by all programmers in write mode
+  WriteRomOptions writeOptions;
+  ReadRomOptions readOptions;
+  int length; // Image bytes to write, 0 for all
+  int noManifest;
+  int usbQueueDepth; // 0 for DEFAULT_USB_QUEUE_DEPTH
+  int retune;
+};
+
+// Opens the image of a write or verify job, from fd when not -1. Takes fd.
+int openJobImage(Job *job, int fd, ImageFile *image) {
+  const int ret = fd < 0 ? openImage(job->filename, image)
+                         : openImageFd(fd, job->filename, image);
+  if (ret < 0) {
+    logMessage(LOG_ERROR, "Cannot open file %s", job->filename);
+    return -1;
+  }
+  job->image = image;
+
+  if (job->length > image->size) {
+    logMessage(LOG_ERROR,
+               "Cannot write %d bytes, %s only has %d",
+               job->length,
+               job->filename,
+               image->size);
+    closeImage(image);
+    return -1;
+  }
+  return 0;
+}
+
+int writeJob(const Job *job, CartCommContext *ccc) {
+  const int size = job->length ? job->length : job->image->size;
+  const RomSource source = {readImage, (void *)job->image, size};
+  WriteRomOptions options = job->writeOptions;
+
+  // The manifest is keyed by serial, anonymous programmers go without
+  CartManifest *manifest = nullptr;
+  if (ccc->serial[0]) {
+    manifest = new CartManifest();
+    if (sampleCart(ccc, manifest) < 0) {
+      delete manifest;
+      return 1;
+    }
+
+    // Still sampled and saved again, so no stale manifest is left behind
+    const int knownSectors =
+      job->noManifest ? 0 : loadManifest(ccc->serial, manifest);
+    logMessage(LOG_INFO,
+               "Cart manifest %08x: %d of %d sectors known",
+               manifest->fingerprint,
+               knownSectors,
+               manifest->numSectors);
+
+    // Stale as soon as the first block is erased
+    removeManifest(ccc->serial, manifest);
+    options.manifest = manifest;
+  }
+
+  logMessage(LOG_INFO,
+             "Writting %s to the ROM at 0x%X",
+             job->filename,
+             options.offset);
+  int ret = 0;
+  if (writeRom(ccc, &source, &options) < 0) {
+    ret = 1;
+  } else if (manifest) {
+    saveManifest(ccc->serial, manifest);
+  }
+
+  delete manifest;
+  return ret;
+}
+
+// Compares the readRom() data against the image, see verifyJob()
+struct VerifySink {
+  const ImageFile *image;
+  int offset; // Image bytes compared so far
+  int mismatches;
+  int firstMismatch; // Image offset of the first differing byte
+};
+
+int verifySinkWrite(void *user, const uint8_t *data, int nBytes) {
+  auto vs = (VerifySink *)user;
+  const uint8_t *expected =
+    readImage((void *)vs->image, vs->offset, nBytes, nullptr);
+  if (!expected) {
+    return -1;
+  }
+
+  for (int i = 0; i < nBytes; i++) {
+    if (data[i] != expected[i]) {
+      if (vs->mismatches == 0) {
+        vs->firstMismatch = vs->offset + i;
+      }
+      vs->mismatches++;
+    }
+  }
+  vs->offset += nBytes;
+  return 0;
+}
+
+// Reads back the cart range a write of the same image would cover and
+// compares it against the image
+int verifyJob(const Job *job, CartCommContext *ccc) {
+  const int size = job->length ? job->length : job->image->size;
+  if (size <= 0) {
+    logMessage(LOG_ERROR, "Nothing to verify, %s is empty", job->filename);
+    return 1;
+  }
+
+  VerifySink vs = {job->image, 0, 0, 0};
+  const RomSink sink = {verifySinkWrite, &vs};
+  ReadRomOptions options = {};
+  options.offset = job->writeOptions.offset;
+  options.length = size;
+
+  logMessage(LOG_INFO,
+             "Verifying %s against the ROM at 0x%X",
+             job->filename,
+             options.offset);
+  if (readRom(ccc, &sink, &options) < 0) {
+    return 1;
+  }
+
+  if (vs.mismatches) {
+    logMessage(LOG_ERROR,
+               "Verify failed: %d bytes differ, the first one at 0x%X",
+               vs.mismatches,
+               options.offset + vs.firstMismatch);
+    return 1;
+  }
+  logMessage(LOG_INFO, "Verify OK: %d bytes match", size);
+  return 0;
+}
+
+// Dumps the cart to f, named outName in the messages
+int dumpJob(const Job *job,
+            CartCommContext *ccc,
+            FILE *f,
+            const char *outName) {
+  logMessage(LOG_INFO, "Reading ROM to %s", outName);
+  const int gzip = isGzipName(job->filename);
+  return dumpRom(ccc, f, gzip, &job->readOptions) < 0 ? 1 : 0;
+}
+
+// Opens the programmer selected by device (see openDeviceAndSetupMPSSE())
+// and sets its read batch size, tuning it if not known yet. Returns nullptr
+// on errors.
+CartCommContext *openProgrammer(const char *device,
+                                int usbQueueDepth,
+                                int retune) {
+  CartCommContext *ccc = new CartCommContext();
+  ccc->usbQueueDepth = usbQueueDepth;
+
+  if (openDeviceAndSetupMPSSE(ccc, device) < 0) {
+    powerOff(ccc);
+    closeDevice(ccc);
+    delete ccc;
+    return nullptr;
+  }
+
+  const int tunedBatch = retune ? 0 : loadReadBatch(ccc->serial);
+  if (tunedBatch > 0 && tunedBatch <= ccc->maxReadBatchSize) {
+    ccc->readBatchSize = tunedBatch;
+  } else if (tuneReadBatch(ccc) > 0) {
+    saveReadBatch(ccc->serial, ccc->readBatchSize);
+  }
+  logMessage(LOG_INFO, "Using read batch size: %d bytes", ccc->readBatchSize);
+  return ccc;
+}
+
+void closeProgrammer(CartCommContext *ccc, int metricsSlot) {
+  powerOff(ccc);
+  closeDevice(ccc);
+  unregisterMetrics(metricsSlot);
+  delete ccc;
+}
+
+// Runs job on the programmer selected by device (see
+// openDeviceAndSetupMPSSE()), dumping to outName in read mode. Returns the
+// exit status.
+int runJob(const Job *job, const char *device, const char *outName) {
+  CartCommContext *ccc =
+    openProgrammer(device, job->usbQueueDepth, job->retune);
+  if (!ccc) {
+    return 1;
+  }
+  const int metricsSlot = registerMetrics(
+    &ccc->metrics, ccc->serial[0] ? ccc->serial : device ? device : "");
+
+  int ret = 0;
+  if (job->mode == 'r') {
+    FILE *f = job->toStdio ? stdout : fopen(outName, "wb");
+    if (!f) {
+      logMessage(LOG_ERROR, "Cannot open file %s for writing", outName);
+      ret = 1;
+    } else {
+      ret = dumpJob(job, ccc, f, outName);
+      if (!job->toStdio) {
+        fclose(f);
+      }
+    }
+  } else if (job->mode == 'v') {
+    ret = verifyJob(job, ccc);
+  } else {
+    ret = writeJob(job, ccc);
+  }
+
+  closeProgrammer(ccc, metricsSlot);
+  return ret;
+}
+
+// Runs job on every attached programmer at once, one thread each
+int runJobOnAll(const Job *job) {
+  ProgrammerInfo programmers[maxProgrammers];
+  char outNames[maxProgrammers][1200];
+  int results[maxProgrammers];
+
+  const int count = listProgrammers(programmers, maxProgrammers);
+  if (count < 0) {
+    return 1;
+  }
+  if (count == 0) {
+    logMessage(LOG_ERROR, "No programmers found");
+    return 1;
+  }
+
+  std::thread workers[maxProgrammers];
+  for (int i = 0; i < count; i++) {
+    const ProgrammerInfo *info = &programmers[i];
+
+    // Dumps go to <output-file>.<serial>, or .<bus>-<address> without one
+    const char *id = info->serial[0] ? info->serial : info->busPath;
+    char suffix[sizeof(info->serial)];
+    int n = 0;
+    for (; id[n] && n < (int)sizeof(suffix) - 1; n++) {
+      suffix[n] = id[n] == '/' ? '-' : id[n];
+    }
+    suffix[n] = 0;
+    snprintf(
+      outNames[i], sizeof(outNames[i]), "%s.%s", job->filename, suffix);
+
+    workers[i] = std::thread([&, i, info] {
+      logTag = info->serial[0] ? info->serial : info->busPath;
+      traceThreadName(logTag);
+      results[i] = runJob(job, info->busPath, outNames[i]);
+    });
+  }
+
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    workers[i].join();
+  }
+  for (int i = 0; i < count; i++) {
+    const ProgrammerInfo *info = &programmers[i];
+    logMessage(results[i] ? LOG_ERROR : LOG_INFO,
+               "%s (%s): %s",
+               info->serial,
+               info->busPath,
+               results[i] ? "FAILED" : "OK");
+    failed += results[i] != 0;
+  }
+
+  logMessage(LOG_INFO, "%d of %d programmers succeeded", count - failed, count);
+  return failed ? 1 : 0;
+}
+
+// Decimal, 0x hex or 0 octal. Returns -1 if text is not a byte count.
+int parseByteCount(const char *text) {
+  char *end;
+  const long value = strtol(text, &end, 0);
+  if (!text[0] || *end || value < 0 || value > INT32_MAX) {
+    return -1;
+  }
+  return (int)value;
+}
+
+int listCommand() {
+  ProgrammerInfo programmers[maxProgrammers];
+
+  const int count = listProgrammers(programmers, maxProgrammers);
+  if (count < 0) {
+    return 1;
+  }
+  for (int i = 0; i < count; i++) {
+    printf("%s %s\n", programmers[i].busPath, programmers[i].serial);
+  }
+  return 0;
+}
+
+// Command line of every command but list
+struct CommandLine {
+  Job job;
+  const char *device;
+  const char *server; // Socket of the server to send the job to
+  const char *metricsPath;
+  const char *tracePath;
+  int allProgrammers;
+};
+
+// Mode of the job a command runs, 0 if it is not one
+char commandMode(const char *command) {
+  if (strcmp(command, "write") == 0) {
+    return 'w';
+  }
+  if (strcmp(command, "read") == 0) {
+    return 'r';
+  }
+  if (strcmp(command, "verify") == 0) {
+    return 'v';
+  }
+  if (strcmp(command, "serve") == 0) {
+    return 's';
+  }
+  return 0;
+}
+
+// Parses the options and file of the command in argv[1]. Returns 0 on
+// success, -1 if the usage message should be printed instead or 1 on errors.
+int parseCommandLine(int argc, char *argv[], CommandLine *cl) {
+  struct optparse_long longopts[] = {{"help", 'h', OPTPARSE_NONE},
+                                     {"diff", 'd', OPTPARSE_NONE},
+                                     {"no-manifest", 'n', OPTPARSE_NONE},
+                                     {"auto-size", 's', OPTPARSE_NONE},
+                                     {"offset", 'o', OPTPARSE_REQUIRED},
+                                     {"length", 'l', OPTPARSE_REQUIRED},
+                                     {"queue-depth", 'q', OPTPARSE_REQUIRED},
+                                     {"tune", 't', OPTPARSE_NONE},
+                                     {"programmer", 'p', OPTPARSE_REQUIRED},
+                                     {"all", 'a', OPTPARSE_NONE},
+                                     {"server", 'S', OPTPARSE_REQUIRED},
+                                     {"metrics", 'm', OPTPARSE_REQUIRED},
+                                     {"trace", 'T', OPTPARSE_REQUIRED},
+                                     {0}};
+
+  *cl = CommandLine();
+  Job *job = &cl->job;
+  job->mode = commandMode(argv[1]);
+  if (!job->mode) {
+    logMessage(LOG_ERROR, "Unknown command: %s", argv[1]);
     return 1;
   }
 
@@ -84,68 +1192,712 @@ int main(int argc, char *argv[]) {
   while ((option = optparse_long(&options, longopts, NULL)) != -1) {
     switch (option) {
       case 'h':
-        usageMessage();
-        return 0;
+        return -1;
+      case 'd':
+        job->writeOptions.differential = 1;
+        break;
+      case 'n':
+        job->noManifest = 1;
+        break;
+      case 's':
+        job->readOptions.autoSize = 1;
+        break;
+      case 'o':
+        job->writeOptions.offset = parseByteCount(options.optarg);
+        job->readOptions.offset = job->writeOptions.offset;
+        if (job->writeOptions.offset < 0) {
+          logMessage(LOG_ERROR, "Invalid offset: %s", options.optarg);
+          return 1;
+        }
+        break;
+      case 'l':
+        job->length = parseByteCount(options.optarg);
+        job->readOptions.length = job->length;
+        if (job->length <= 0) {
+          logMessage(LOG_ERROR, "Invalid length: %s", options.optarg);
+          return 1;
+        }
+        break;
+      case 'q':
+        job->usbQueueDepth = parseByteCount(options.optarg);
+        if (job->usbQueueDepth < 1 ||
+            job->usbQueueDepth > MAX_USB_QUEUE_DEPTH) {
+          logMessage(LOG_ERROR,
+                     "Invalid queue depth, 1 to %d: %s",
+                     MAX_USB_QUEUE_DEPTH,
+                     options.optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        job->retune = 1;
+        break;
+      case 'p':
+        cl->device = options.optarg;
+        break;
+      case 'a':
+        cl->allProgrammers = 1;
+        break;
+      case 'S':
+        cl->server = options.optarg;
+        break;
+      case 'm':
+        cl->metricsPath = options.optarg;
+        break;
+      case 'T':
+        cl->tracePath = options.optarg;
+        break;
+      case '?':
+        logMessage(LOG_ERROR, "%s", options.errmsg);
+        return 1;
     }
   }
 
   // If filename was not passed
   if (options.optind + 1 >= argc) {
-    usageMessage();
-    return 0;
+    return -1;
+  }
+
+  // "-" reads the image from stdin or dumps the ROM to stdout
+  job->filename = argv[options.optind + 1];
+  job->toStdio = strcmp(job->filename, "-") == 0;
+  if (job->mode == 's' && job->toStdio) {
+    logMessage(LOG_ERROR, "The server needs a socket path");
+    return 1;
+  }
+  if (isZstdName(job->filename)) {
+    logMessage(
+      LOG_ERROR, "Cannot use %s, only .gz is supported", job->filename);
+    return 1;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Server
+
+// "hm05 serve socket" keeps its programmers open and powered, and runs the
+// jobs "hm05 read/write/verify -S socket" clients send it over a Unix
+// seqpacket socket, in order on each programmer. A request holds the client
+// command line after "hm05", each argument NUL terminated, and carries the
+// image or dump file descriptor. The messages logged while the job runs go
+// back as packets starting with I (info) or E (error), followed by a last one
+// holding X and the exit status.
+const int maxRequestSize = 8192;
+const int maxRequestArgs = 64;
+// Connected clients waiting to send their request, and how long they may take
+const int maxPendingClients = 16;
+const int requestTimeoutMs = 1000;
+
+struct ServedJob {
+  int client;
+  int fd; // Image or dump file of the client, -1 once taken
+  char request[maxRequestSize];
+  char *argv[maxRequestArgs + 2];
+  CommandLine cl; // Points into request
+  ServedJob *next;
+};
+
+struct ServedProgrammer {
+  CartCommContext *ccc;
+  int metricsSlot;
+  char device[64]; // As opened, matched with the -p of the jobs
+  char tag[64];
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cond;
+  ServedJob *head; // Waiting jobs, oldest first
+  ServedJob *tail;
+  int queued; // Waiting and running jobs
+  uint8_t stop;
+};
+
+// SIGINT and SIGTERM stop the server. main() blocks them before starting any
+// thread and serveCommand() takes them from a signalfd, so none is lost
+// between two accept() calls or handled by another thread.
+void stopSignalSet(sigset_t *set) {
+  sigemptyset(set);
+  sigaddset(set, SIGINT);
+  sigaddset(set, SIGTERM);
+}
+
+int unixSocketAddress(sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    logMessage(LOG_ERROR, "Socket path too long: %s", path);
+    return -1;
   }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
 
-  struct ftdi_context *ftdi = ftdi_new();
+void sendExitStatus(int client, int status) {
+  char packet[16];
+  const int length = snprintf(packet, sizeof(packet), "X%d", status);
+  send(client, packet, length, MSG_NOSIGNAL);
+}
 
-  if (ftdi == 0) {
+void freeServedJob(ServedJob *sj) {
+  close(sj->client);
+  if (sj->fd >= 0) {
+    close(sj->fd);
+  }
+  delete sj;
+}
+
+// Runs sj on the programmer of sp. Returns the exit status.
+int runServedJob(ServedProgrammer *sp, ServedJob *sj) {
+  Job *job = &sj->cl.job;
+  CartCommContext *ccc = sp->ccc;
+
+  if (identifyFlashChip(ccc) < 0) {
+    logMessage(LOG_ERROR, "Flash chip identification failed");
     return 1;
   }
 
-  if (openDeviceAndSetupMPSSE(ftdi, &ccc) < 0) {
-    powerOff(&ccc);
+  if (job->mode == 'r') {
+    FILE *f = fdopen(sj->fd, "wb");
+    if (!f) {
+      logMessage(LOG_ERROR, "Cannot open file %s for writing", job->filename);
+      return 1;
+    }
+    sj->fd = -1;
+    int ret = dumpJob(job, ccc, f, job->filename);
+    if (fclose(f) != 0) {
+      ret = 1;
+    }
+    return ret;
+  }
+
+  ImageFile image;
+  const int fd = sj->fd;
+  sj->fd = -1;
+  if (openJobImage(job, fd, &image) < 0) {
     return 1;
   }
+  const int ret = job->mode == 'v' ? verifyJob(job, ccc) : writeJob(job, ccc);
+  closeImage(&image);
+  return ret;
+}
 
-  FILE *f;
-  const auto filename = argv[options.optind + 1];
-  switch (mode) {
-    case 'r':
-      f = fopen(filename, "wb");
-      if (!f) {
-        logMessage(LOG_ERROR, "Cannot open file %s for writing", filename);
-        powerOff(&ccc);
-        return -1;
+void serveProgrammer(ServedProgrammer *sp) {
+  logTag = sp->tag;
+  traceThreadName(sp->tag);
+  std::unique_lock<std::mutex> lock(sp->mutex);
+
+  for (;;) {
+    sp->cond.wait(lock, [&] { return sp->stop || sp->head; });
+    if (sp->stop) {
+      return;
+    }
+
+    ServedJob *sj = sp->head;
+    sp->head = sj->next;
+    if (!sp->head) {
+      sp->tail = nullptr;
+    }
+    lock.unlock();
+
+    logClient = sj->client;
+    logMessage(LOG_INFO, "Running %s job on %s", sj->argv[1], sp->tag);
+    const int status = runServedJob(sp, sj);
+    logClient = -1;
+    sendExitStatus(sj->client, status);
+    freeServedJob(sj);
+
+    lock.lock();
+    sp->queued--;
+  }
+}
+
+// Reads the request of a client into a job, once poll() saw it arrive.
+// Returns nullptr after telling the client what is wrong with it.
+ServedJob *receiveRequest(int client) {
+  ServedJob *sj = new ServedJob();
+  sj->client = client;
+  sj->fd = -1;
+
+  char control[CMSG_SPACE(sizeof(int))];
+  iovec iov = {sj->request, maxRequestSize - 1};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  const ssize_t n = recvmsg(client, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+  if (n > 0) {
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+        memcpy(&sj->fd, CMSG_DATA(c), sizeof(int));
       }
+    }
+  }
+
+  // Arguments after "hm05", the command first
+  int argc = 1;
+  sj->argv[0] = (char *)"hm05";
+  for (int pos = 0; n > 0 && pos < n && argc <= maxRequestArgs; argc++) {
+    sj->argv[argc] = sj->request + pos;
+    pos += strnlen(sj->request + pos, n - pos) + 1;
+  }
+  sj->argv[argc] = nullptr;
+  sj->request[n > 0 ? n : 0] = 0;
+
+  logClient = client;
+  int ok = n > 0 && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) &&
+           sj->fd >= 0 && argc > 1 && argc <= maxRequestArgs &&
+           sj->request[n - 1] == 0;
+  if (!ok) {
+    logMessage(LOG_ERROR, "Invalid request");
+  } else if (parseCommandLine(argc, sj->argv, &sj->cl) != 0) {
+    logMessage(LOG_ERROR, "Invalid job: %s", sj->argv[1]);
+    ok = 0;
+  } else if (sj->cl.job.mode == 's' || sj->cl.allProgrammers ||
+             sj->cl.metricsPath || sj->cl.tracePath ||
+             sj->cl.job.usbQueueDepth || sj->cl.job.retune) {
+    // The programmers stay open with the transport and read batch the
+    // server set up
+    logMessage(LOG_ERROR, "Option not available for served jobs");
+    ok = 0;
+  }
+  logClient = -1;
+
+  if (!ok) {
+    sendExitStatus(client, 1);
+    freeServedJob(sj);
+    return nullptr;
+  }
+  return sj;
+}
 
-      logMessage(LOG_INFO, "Reading ROM to %s", filename);
-      readRom(&ccc);
+// Queues sj on the programmer it asks for, or the least busy one
+void dispatchJob(ServedProgrammer *served, int count, ServedJob *sj) {
+  const char *device = sj->cl.device;
+  ServedProgrammer *target = nullptr;
 
-      fwrite(ccc.romBuffer, 1, ROM_BUFFER_SIZE, f);
-      fflush(f);
-      fclose(f);
+  int targetQueued = 0;
+
+  for (int i = 0; i < count; i++) {
+    ServedProgrammer *sp = &served[i];
+    int queued;
+    {
+      std::lock_guard<std::mutex> lock(sp->mutex);
+      queued = sp->queued;
+    }
+    if (device ? strcmp(device, sp->ccc->serial) == 0 ||
+                   strcmp(device, sp->device) == 0
+               : !target || queued < targetQueued) {
+      target = sp;
+      targetQueued = queued;
+    }
+  }
+
+  if (!target) {
+    logClient = sj->client;
+    logMessage(LOG_ERROR, "Programmer %s is not served here", device);
+    logClient = -1;
+    sendExitStatus(sj->client, 1);
+    freeServedJob(sj);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(target->mutex);
+  if (target->tail) {
+    target->tail->next = sj;
+  } else {
+    target->head = sj;
+  }
+  target->tail = sj;
+  target->queued++;
+  target->cond.notify_all();
+}
+
+int listenOn(const char *path) {
+  sockaddr_un addr;
+  if (unixSocketAddress(&addr, path) < 0) {
+    return -1;
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    logMessage(LOG_ERROR, "Unable to create socket: %s", strerror(errno));
+    return -1;
+  }
+
+  // Left behind by a server that did not stop cleanly
+  unlink(path);
+  if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+    logMessage(
+      LOG_ERROR, "Unable to listen on %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Serves the programmers cl selects at the socket named by its file, until
+// SIGINT or SIGTERM. Returns the exit status.
+int serveCommand(const CommandLine *cl) {
+  ProgrammerInfo programmers[maxProgrammers];
+  const char *devices[maxProgrammers] = {cl->device};
+  int count = 1;
+
+  if (cl->allProgrammers) {
+    count = listProgrammers(programmers, maxProgrammers);
+    if (count < 0) {
+      return 1;
+    }
+    if (count == 0) {
+      logMessage(LOG_ERROR, "No programmers found");
+      return 1;
+    }
+    for (int i = 0; i < count; i++) {
+      devices[i] = programmers[i].busPath;
+    }
+  }
+
+  ServedProgrammer *served = new ServedProgrammer[count];
+  int opened = 0;
+  for (; opened < count; opened++) {
+    ServedProgrammer *sp = &served[opened];
+    sp->ccc = openProgrammer(
+      devices[opened], cl->job.usbQueueDepth, cl->job.retune);
+    if (!sp->ccc) {
       break;
-    case 'w':
-      f = fopen(filename, "rb");
-      if (!f) {
-        logMessage(LOG_ERROR, "Cannot open file %s", filename);
-        powerOff(&ccc);
-        return -1;
+    }
+    snprintf(sp->device,
+             sizeof(sp->device),
+             "%s",
+             devices[opened] ? devices[opened] : "");
+    snprintf(sp->tag,
+             sizeof(sp->tag),
+             "%s",
+             sp->ccc->serial[0] ? sp->ccc->serial : sp->device);
+    sp->metricsSlot = registerMetrics(&sp->ccc->metrics, sp->tag);
+    sp->head = nullptr;
+    sp->tail = nullptr;
+    sp->queued = 0;
+    sp->stop = 0;
+  }
+
+  const int listenFd = opened == count ? listenOn(cl->job.filename) : -1;
+  int ret = listenFd < 0 ? 1 : 0;
+
+  sigset_t stopSignals;
+  stopSignalSet(&stopSignals);
+  const int signalFd =
+    listenFd >= 0 ? signalfd(-1, &stopSignals, SFD_CLOEXEC) : -1;
+  if (listenFd >= 0 && signalFd < 0) {
+    logMessage(LOG_ERROR, "Unable to wait for signals: %s", strerror(errno));
+    close(listenFd);
+    unlink(cl->job.filename);
+    ret = 1;
+  }
+
+  if (signalFd >= 0) {
+    // Clients going away must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < count; i++) {
+      served[i].worker = std::thread(serveProgrammer, &served[i]);
+    }
+
+    logMessage(LOG_INFO,
+               "Serving %d programmer(s) on %s",
+               count,
+               cl->job.filename);
+    // Clients are accepted right away and polled along with the listening
+    // socket and the signalfd until their request arrives, so a slow one
+    // holds no other client up
+    pollfd fds[2 + maxPendingClients];
+    int64_t acceptedUs[maxPendingClients]; // Oldest first
+    int pending = 0;
+    fds[0] = {listenFd, POLLIN, 0};
+    fds[1] = {signalFd, POLLIN, 0};
+    for (;;) {
+      // Clients wait in the listen backlog while every slot is taken
+      fds[0].events = pending < maxPendingClients ? POLLIN : 0;
+      int timeoutMs = -1;
+      if (pending > 0) {
+        const int64_t waitedMs = (monotonicUs() - acceptedUs[0]) / 1000;
+        timeoutMs =
+          waitedMs < requestTimeoutMs ? (int)(requestTimeoutMs - waitedMs) : 0;
       }
-      fseek(f, 0, SEEK_END);
-      const int romSize = ftell(f);
-      fseek(f, 0L, SEEK_SET);
-      fread(ccc.romBuffer, 1, romSize, f);
-      fclose(f);
-
-      logMessage(LOG_INFO, "Writting ROM to %s", filename);
-      writeRom(&ccc, romSize);
+
+      if (poll(fds, 2 + pending, timeoutMs) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        logMessage(LOG_ERROR, "Unable to poll: %s", strerror(errno));
+        ret = 1;
+        break;
+      }
+      if (fds[1].revents) {
+        break;
+      }
+
+      // Requests come in a single packet
+      const int64_t now = monotonicUs();
+      int kept = 0;
+      for (int i = 0; i < pending; i++) {
+        const int client = fds[2 + i].fd;
+        if (fds[2 + i].revents) {
+          ServedJob *sj = receiveRequest(client);
+          if (sj) {
+            dispatchJob(served, count, sj);
+          }
+        } else if (now - acceptedUs[i] >= requestTimeoutMs * 1000) {
+          logClient = client;
+          logMessage(LOG_ERROR, "No request received");
+          logClient = -1;
+          sendExitStatus(client, 1);
+          close(client);
+        } else {
+          fds[2 + kept] = fds[2 + i];
+          acceptedUs[kept] = acceptedUs[i];
+          kept++;
+        }
+      }
+      pending = kept;
+
+      if (!(fds[0].revents & POLLIN)) {
+        continue;
+      }
+      const int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        logMessage(LOG_ERROR, "Unable to accept: %s", strerror(errno));
+        ret = 1;
+        break;
+      }
+      fds[2 + pending] = {client, POLLIN, 0};
+      acceptedUs[pending] = now;
+      pending++;
+    }
+
+    // Clients that never sent a request see the connection close
+    for (int i = 0; i < pending; i++) {
+      close(fds[2 + i].fd);
+    }
+    logMessage(LOG_INFO, "Stopping after the running jobs");
+    close(signalFd);
+    close(listenFd);
+    unlink(cl->job.filename);
+
+    // Waiting jobs are dropped, their clients see the connection close
+    for (int i = 0; i < count; i++) {
+      ServedProgrammer *sp = &served[i];
+      {
+        std::lock_guard<std::mutex> lock(sp->mutex);
+        sp->stop = 1;
+      }
+      sp->cond.notify_all();
+      sp->worker.join();
+
+      while (sp->head) {
+        ServedJob *next = sp->head->next;
+        freeServedJob(sp->head);
+        sp->head = next;
+      }
+    }
+  }
+
+  for (int i = 0; i < opened; i++) {
+    closeProgrammer(served[i].ccc, served[i].metricsSlot);
+  }
+  delete[] served;
+  return ret;
+}
+
+// Sends the job of argv to the server at cl->server along with its file and
+// relays the messages of the job. Returns the exit status of the job.
+int runClient(int argc, char *argv[], const CommandLine *cl) {
+  const Job *job = &cl->job;
+  sockaddr_un addr;
+  if (unixSocketAddress(&addr, cl->server) < 0) {
+    return 1;
+  }
+
+  // The server takes the file opened here, so it needs no access to it
+  char request[maxRequestSize];
+  int length = 0;
+  for (int i = 1; i < argc; i++) {
+    const int argLength = strlen(argv[i]) + 1;
+    if (i > maxRequestArgs || length + argLength > maxRequestSize - 1) {
+      logMessage(LOG_ERROR, "Command line too long for the server");
+      return 1;
+    }
+    memcpy(request + length, argv[i], argLength);
+    length += argLength;
+  }
+
+  int fd;
+  if (job->toStdio) {
+    fd = job->mode == 'r' ? 1 : 0;
+  } else if (job->mode == 'r') {
+    fd = open(job->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  } else {
+    fd = open(job->filename, O_RDONLY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    logMessage(LOG_ERROR, "Cannot open file %s", job->filename);
+    return 1;
+  }
+
+  const int server = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (server < 0 || connect(server, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    logMessage(LOG_ERROR,
+               "Unable to connect to %s: %s",
+               cl->server,
+               strerror(errno));
+    if (server >= 0) {
+      close(server);
+    }
+    if (!job->toStdio) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  iovec iov = {request, (size_t)length};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+  const int sent = sendmsg(server, &msg, MSG_NOSIGNAL) == length;
+  if (!job->toStdio) {
+    close(fd);
+  }
+  if (!sent) {
+    logMessage(LOG_ERROR, "Unable to send the job: %s", strerror(errno));
+    close(server);
+    return 1;
+  }
+
+  // Messages until the exit status
+  char packet[logBufferLength + 1];
+  int status = -1;
+  while (status < 0) {
+    const ssize_t n = recv(server, packet, sizeof(packet) - 1, 0);
+    if (n <= 0) {
+      logMessage(LOG_ERROR, "Server closed the connection");
+      status = 1;
       break;
+    }
+    packet[n] = 0;
+
+    if (packet[0] == 'X') {
+      status = atoi(packet + 1);
+    } else {
+      logMessage(
+        packet[0] == 'E' ? LOG_ERROR : LOG_INFO, "%s", packet + 1);
+    }
   }
 
-  powerOff(&ccc);
-  ftdi_usb_close(ftdi);
-  ftdi_deinit(ftdi);
-  return 0;
+  close(server);
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usageMessage();
+    return 0;
+  }
+
+  if (strcmp(argv[1], "list") == 0) {
+    return listCommand();
+  }
+
+  if (!commandMode(argv[1])) {
+    usageMessage();
+    return 1;
+  }
+
+  CommandLine cl;
+  const int parsed = parseCommandLine(argc, argv, &cl);
+  if (parsed < 0) {
+    usageMessage();
+    return 0;
+  }
+  if (parsed > 0) {
+    return 1;
+  }
+  Job &job = cl.job;
+
+  if (job.mode == 'r' && job.toStdio) {
+    if (cl.allProgrammers) {
+      logMessage(LOG_ERROR, "Cannot dump several programmers to stdout");
+      return 1;
+    }
+    infoLog = stderr;
+    // A reader closing the pipe early must not skip powering the cart off
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  if (cl.server) {
+    if (job.mode == 's' || cl.allProgrammers || cl.metricsPath ||
+        cl.tracePath || job.usbQueueDepth || job.retune) {
+      logMessage(LOG_ERROR, "Option not available with --server");
+      return 1;
+    }
+    return runClient(argc, argv, &cl);
+  }
+
+  ImageFile image;
+  if ((job.mode == 'w' || job.mode == 'v') &&
+      openJobImage(&job, -1, &image) < 0) {
+    return 1;
+  }
+
+  if (job.mode == 's') {
+    sigset_t stopSignals;
+    stopSignalSet(&stopSignals);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+  }
+
+  metricsRegistry.path = cl.metricsPath;
+  if (metricsRegistry.path) {
+    startMetricsSignalThread();
+  }
+  if (cl.tracePath) {
+    traceStart();
+    traceThreadName("main");
+  }
+
+  int ret;
+  if (job.mode == 's') {
+    ret = serveCommand(&cl);
+  } else if (cl.allProgrammers) {
+    ret = runJobOnAll(&job);
+  } else {
+    ret = runJob(&job, cl.device, job.filename);
+  }
+
+  if (metricsRegistry.path) {
+    if (writeMetrics() < 0) {
+      ret = 1;
+    }
+    freeMetrics();
+  }
+  if (cl.tracePath && writeTrace(cl.tracePath) < 0) {
+    ret = 1;
+  }
+
+  if (job.mode == 'w' || job.mode == 'v') {
+    closeImage(&image);
+  }
+  return ret;
 }
 
 #ifdef IS_POSIX
@@ -157,4 +1909,10 @@ void sleepMs(unsigned int ms) {
   nanosleep(&req, nullptr);
 }
 
+int64_t monotonicUs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 #endif
@@ -25,6 +25,10 @@ SOFTWARE.
 
 #include <ftdi.h>
 #include <cassert>
+#include "encoder.hpp"
+#include "flash_driver.hpp"
+#include "metrics.hpp"
+#include "transport.hpp"
 
 #if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
 #define IS_POSIX
@@ -39,8 +43,18 @@ SOFTWARE.
 #define LOG_INFO  1
 #define LOG_ERROR 2
 
-#define OUT_BUFFER_SIZE 4 * 1024 * 1024
-#define ROM_BUFFER_SIZE 2 * 1024 * 1024
+// Big enough for a whole read batch of read records
+#define OUT_BUFFER_SIZE 64 * 1024
+// Biggest FTDI chip buffer, holds a read batch of full-duplex answers
+#define IN_BUFFER_SIZE 4096
+// The cart bus carries 21 address bits, so no chip or image is bigger
+#define MAX_ROM_SIZE (1 << 21)
+
+// Erase blocks and sectors a cart manifest can describe
+#define MAX_MANIFEST_BLOCKS 1024
+#define MAX_MANIFEST_SECTORS 4096
+// Bytes read from the start of every block to fingerprint a cart
+#define MANIFEST_SAMPLE_BYTES 256
 
 #pragma pack(push, 1)
 
@@ -71,29 +85,138 @@ struct CFIQueryStruct {
 #pragma pack(pop)
 
 struct CartCommContext {
-  ftdi_context *ftdi;
+  UsbTransport usb;
+  int usbQueueDepth; // Transfers in flight, 0 for the default
   uint8_t outBuffer[OUT_BUFFER_SIZE];
-  int outBufferPos;
+  CommandBuffer out; // Wraps outBuffer
+  uint8_t inBuffer[IN_BUFFER_SIZE];
   CFIQueryStruct cfiqs;
   CFIBlockRegion blockRegions[256];
   uint8_t lowDataBits;
   uint8_t poweredOn;
   uint8_t mpsseOn;
   uint8_t chipId[3];
-  uint8_t romBuffer[ROM_BUFFER_SIZE];
+  const FlashDriver *driver; // Command set of the detected chip
   uint32_t biggestBlockSizeBytes;
+  uint32_t smallestBlockSizeBytes; // Sector size, the finest erase unit
+  // The CFI regions are alternative erase sizes that span the whole chip,
+  // like the SST39VF168x sectors and blocks, not consecutive address ranges
+  uint8_t overlappingRegions;
+  char serial[64];         // Programmer serial number
+  int readBatchSize;       // Bytes read per USB round trip
+  uint8_t lsbFirstReads;   // Data bits reversed by the MPSSE, not in software
+  int duplexDataBit;       // Full-duplex reads data MSB bit, 0 if not used
+  int maxReadBatchSize;    // Largest batch the FTDI chip buffer allows
+  int programTimeoutUs;    // Max byte program time from CFI
+  int bufferTimeoutUs;     // Max write buffer program time, 0 if no buffer
+  int blockEraseTimeoutUs; // Max block erase time from CFI
+  int chipEraseTimeoutUs;  // Max chip erase time from CFI, 0 if unsupported
+  Metrics metrics;
+};
+
+// Supplies the image to writeRom(), one erase unit at a time with increasing
+// offsets, in up to two passes. read() returns a pointer to nBytes at offset,
+// either into the source's own memory or to scratch after filling it, or
+// nullptr on errors. It runs on the encoder thread, the planning pass on the
+// calling one.
+struct RomSource {
+  const uint8_t *(*read)(void *user, int offset, int nBytes, uint8_t *scratch);
+  void *user;
+  int size; // Image size in bytes
+};
+
+// Receives readRom() data in address order. write() returns < 0 on errors.
+struct RomSink {
+  int (*write)(void *user, const uint8_t *data, int nBytes);
+  void *user;
+};
+
+// What a cart holds, as left by the last verified write. Sectors are
+// identified by the CRC32C of their contents, the fingerprint mixes the chip
+// ID with the CRC32C of the first MANIFEST_SAMPLE_BYTES of every block.
+struct CartManifest {
+  int blockSize; // Sampled blocks, whole chip
+  int numBlocks;
+  int sectorSize; // Hashed sectors, whole chip
+  int numSectors;
+  uint32_t fingerprint;
+  uint32_t sampleHashes[MAX_MANIFEST_BLOCKS];
+  uint32_t sectorHashes[MAX_MANIFEST_SECTORS];
+  uint8_t known[MAX_MANIFEST_SECTORS]; // sectorHashes[i] is valid
+};
+
+struct WriteRomOptions {
+  uint8_t differential; // Read each block first, rewrite only if it differs
+  // Blocks it knows to match the image are skipped without reading them.
+  // Updated to the new cart contents when the write succeeds. May be null.
+  CartManifest *manifest;
+  int offset; // Cart address of the first image byte
 };
 
-// User must implement this function
+struct ReadRomOptions {
+  int offset; // Cart address of the first byte read
+  int length; // Bytes to read, 0 for up to the end of the chip
+  // Stop at the last block holding data and leave the trailing erased bytes
+  // out of the dump
+  uint8_t autoSize;
+};
+
+// User must implement these functions
 void logMessage(int logLevel, const char *formatString, ...);
 
-int openDeviceAndSetupMPSSE(struct ftdi_context *ftdi, CartCommContext *ccc);
+// Where the messages of the calling thread go. Threads started to help
+// another one take its context, so their messages end up in the same place.
+struct LogContext {
+  const char *tag; // Prefixed to the messages, or nullptr
+  int client;      // Server connection also getting them, or -1
+};
+LogContext getLogContext();
+void setLogContext(LogContext context);
+
+struct ProgrammerInfo {
+  char serial[64];
+  char busPath[16]; // BBB/DDD, USB bus and device address
+};
+
+// Fills dst with up to maxCount attached programmers. Returns how many were
+// found or -1 on errors.
+int listProgrammers(ProgrammerInfo *dst, int maxCount);
+
+// Opens the programmer selected by device, either a serial number, a BBB/DDD
+// bus path or "emu[:options]" for the emulator. A null device opens the first
+// programmer found.
+int openDeviceAndSetupMPSSE(CartCommContext *ccc, const char *device);
+// Reads the Id and CFI query of the cart and selects its flash driver. Done
+// when opening the programmer, and again before each job a server runs since
+// the cart may have been swapped.
+int identifyFlashChip(CartCommContext *ccc);
+void closeDevice(CartCommContext *ccc);
 int powerOn(CartCommContext *ccc);
 int powerOff(CartCommContext *ccc);
 
-int readRom(CartCommContext *ccc);
-int writeRom(CartCommContext *ccc, int romSize);
+// Measures read throughput for batch sizes up to maxReadBatchSize and keeps
+// the fastest one. Returns the chosen size.
+int tuneReadBatch(CartCommContext *ccc);
+
+// Reads the samples of every block and fills in the fingerprint of the cart.
+// No sector hash is known afterwards.
+int sampleCart(CartCommContext *ccc, CartManifest *manifest);
+uint32_t cartFingerprint(const CartCommContext *ccc,
+                         const CartManifest *manifest);
+
+// Returns the number of bytes dumped or -1 on errors
+int readRom(CartCommContext *ccc,
+            const RomSink *sink,
+            const ReadRomOptions *options);
+
+// Writes the image at options->offset. Only the sectors it touches are
+// erased, the cart bytes they hold around the image are read first and
+// programmed back.
+int writeRom(CartCommContext *ccc,
+             const RomSource *source,
+             const WriteRomOptions *options);
 
 void sleepMs(unsigned int ms);
+int64_t monotonicUs();
 
 #endif
@@ -0,0 +1,208 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "metrics.hpp"
+
+const char *counterNames[METRIC_COUNTERS] = {
+  "bytes_enqueued",
+  "bytes_flushed",
+  "usb_writes",
+  "usb_reads",
+  "usb_read_bytes",
+  "sleep_us",
+  "read_wait_us",
+  "status_polls",
+  "blocks_erased",
+  "blocks_programmed",
+  "blocks_verified",
+  "blocks_skipped",
+  "verify_failures",
+  "rom_bytes_written",
+  "rom_bytes_read",
+  "write_us",
+  "read_us",
+};
+
+const char *histogramNames[METRIC_HISTOGRAMS] = {
+  "flush_us",
+  "usb_read_us",
+  "erase_us",
+  "program_us",
+  "verify_us",
+};
+
+void metricsReset(Metrics *m) {
+  for (int i = 0; i < METRIC_COUNTERS; i++) {
+    m->counters[i] = 0;
+  }
+  for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+    Histogram *h = &m->histograms[i];
+    for (int j = 0; j < histogramBuckets; j++) {
+      h->buckets[j] = 0;
+    }
+    h->count = 0;
+    h->sum = 0;
+  }
+}
+
+void metricsCopy(Metrics *dst, const Metrics *src) {
+  for (int i = 0; i < METRIC_COUNTERS; i++) {
+    dst->counters[i] = src->counters[i].load();
+  }
+  for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+    Histogram *d = &dst->histograms[i];
+    const Histogram *s = &src->histograms[i];
+    for (int j = 0; j < histogramBuckets; j++) {
+      d->buckets[j] = s->buckets[j].load();
+    }
+    d->count = s->count.load();
+    d->sum = s->sum.load();
+  }
+}
+
+// Bytes per second over the time spent in writeRom()/readRom()
+double throughput(const Metrics *m, MetricCounter bytes, MetricCounter us) {
+  const int64_t elapsed = m->counters[us];
+  return elapsed > 0 ? m->counters[bytes] * 1e6 / elapsed : 0;
+}
+
+void writeMetricsJson(FILE *f,
+                      const Metrics *const *metrics,
+                      const char *const *labels,
+                      int count) {
+  fprintf(f, "{\"programmers\": [");
+  for (int p = 0; p < count; p++) {
+    const Metrics *m = metrics[p];
+
+    fprintf(f, "%s\n {\"programmer\": \"%s\",\n", p ? "," : "", labels[p]);
+
+    fprintf(f, "  \"counters\": {");
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+      fprintf(f,
+              "%s\"%s\": %lld",
+              i ? ", " : "",
+              counterNames[i],
+              (long long)m->counters[i]);
+    }
+    fprintf(f, "},\n");
+
+    fprintf(f,
+            "  \"write_bytes_per_second\": %.1f,\n"
+            "  \"read_bytes_per_second\": %.1f,\n",
+            throughput(m, METRIC_ROM_BYTES_WRITTEN, METRIC_WRITE_US),
+            throughput(m, METRIC_ROM_BYTES_READ, METRIC_READ_US));
+
+    // Only non empty buckets, each one with its upper bound
+    fprintf(f, "  \"histograms\": {");
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+      const Histogram *h = &m->histograms[i];
+      fprintf(f,
+              "%s\n   \"%s\": {\"count\": %lld, \"sum\": %lld, \"buckets\": [",
+              i ? "," : "",
+              histogramNames[i],
+              (long long)h->count,
+              (long long)h->sum);
+
+      int first = 1;
+      for (int j = 0; j < histogramBuckets; j++) {
+        if (h->buckets[j] == 0) {
+          continue;
+        }
+        fprintf(f,
+                "%s{\"le\": %lld, \"count\": %lld}",
+                first ? "" : ", ",
+                (long long)1 << j,
+                (long long)h->buckets[j]);
+        first = 0;
+      }
+      fprintf(f, "]}");
+    }
+    fprintf(f, "}}");
+  }
+  fprintf(f, "\n]}\n");
+}
+
+void writeMetricsOpenMetrics(FILE *f,
+                             const Metrics *const *metrics,
+                             const char *const *labels,
+                             int count) {
+  for (int i = 0; i < METRIC_COUNTERS; i++) {
+    fprintf(f, "# TYPE hm05_%s counter\n", counterNames[i]);
+    for (int p = 0; p < count; p++) {
+      fprintf(f,
+              "hm05_%s_total{programmer=\"%s\"} %lld\n",
+              counterNames[i],
+              labels[p],
+              (long long)metrics[p]->counters[i]);
+    }
+  }
+
+  fprintf(f, "# TYPE hm05_write_bytes_per_second gauge\n");
+  for (int p = 0; p < count; p++) {
+    fprintf(f,
+            "hm05_write_bytes_per_second{programmer=\"%s\"} %.1f\n",
+            labels[p],
+            throughput(metrics[p], METRIC_ROM_BYTES_WRITTEN, METRIC_WRITE_US));
+  }
+  fprintf(f, "# TYPE hm05_read_bytes_per_second gauge\n");
+  for (int p = 0; p < count; p++) {
+    fprintf(f,
+            "hm05_read_bytes_per_second{programmer=\"%s\"} %.1f\n",
+            labels[p],
+            throughput(metrics[p], METRIC_ROM_BYTES_READ, METRIC_READ_US));
+  }
+
+  for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+    fprintf(f, "# TYPE hm05_%s histogram\n", histogramNames[i]);
+    for (int p = 0; p < count; p++) {
+      const Histogram *h = &metrics[p]->histograms[i];
+
+      // Buckets are cumulative
+      int64_t cumulative = 0;
+      for (int j = 0; j < histogramBuckets - 1; j++) {
+        cumulative += h->buckets[j];
+        fprintf(f,
+                "hm05_%s_bucket{programmer=\"%s\",le=\"%lld\"} %lld\n",
+                histogramNames[i],
+                labels[p],
+                (long long)1 << j,
+                (long long)cumulative);
+      }
+      fprintf(f,
+              "hm05_%s_bucket{programmer=\"%s\",le=\"+Inf\"} %lld\n",
+              histogramNames[i],
+              labels[p],
+              (long long)h->count);
+      fprintf(f,
+              "hm05_%s_count{programmer=\"%s\"} %lld\n",
+              histogramNames[i],
+              labels[p],
+              (long long)h->count);
+      fprintf(f,
+              "hm05_%s_sum{programmer=\"%s\"} %lld\n",
+              histogramNames[i],
+              labels[p],
+              (long long)h->sum);
+    }
+  }
+  fprintf(f, "# EOF\n");
+}
@@ -0,0 +1,106 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+// Hot path counters and latency histograms, one set per programmer. Updates
+// are relaxed atomics so a signal triggered dump can read them while the
+// worker threads keep running.
+
+enum MetricCounter {
+  METRIC_BYTES_ENQUEUED,   // MPSSE command bytes encoded
+  METRIC_BYTES_FLUSHED,    // MPSSE command bytes handed to the transport
+  METRIC_USB_WRITES,       // transportWrite() calls
+  METRIC_USB_READS,        // transportRead() calls
+  METRIC_USB_READ_BYTES,   // Answer bytes received
+  METRIC_SLEEP_US,         // Time spent in sleepMs()
+  METRIC_READ_WAIT_US,     // Time spent waiting for answers
+  METRIC_STATUS_POLLS,     // DQ7/DQ6 status poll round trips
+  METRIC_BLOCKS_ERASED,
+  METRIC_BLOCKS_PROGRAMMED,
+  METRIC_BLOCKS_VERIFIED,
+  METRIC_BLOCKS_SKIPPED,   // Unchanged in differential mode
+  METRIC_VERIFY_FAILURES,
+  METRIC_ROM_BYTES_WRITTEN,
+  METRIC_ROM_BYTES_READ,
+  METRIC_WRITE_US,         // Time spent in writeRom()
+  METRIC_READ_US,          // Time spent in readRom()
+  METRIC_COUNTERS,
+};
+
+enum MetricHistogram {
+  HISTOGRAM_FLUSH_US,    // Per flushOut()
+  HISTOGRAM_USB_READ_US, // Per transportRead()
+  HISTOGRAM_ERASE_US,    // Per block
+  HISTOGRAM_PROGRAM_US,  // Per block
+  HISTOGRAM_VERIFY_US,   // Per block
+  METRIC_HISTOGRAMS,
+};
+
+// Bucket i counts values up to 2^i microseconds, the last one everything else
+const int histogramBuckets = 32;
+
+struct Histogram {
+  std::atomic<int64_t> buckets[histogramBuckets];
+  std::atomic<int64_t> count;
+  std::atomic<int64_t> sum;
+};
+
+struct Metrics {
+  std::atomic<int64_t> counters[METRIC_COUNTERS];
+  Histogram histograms[METRIC_HISTOGRAMS];
+};
+
+inline void metricsAdd(Metrics *m, MetricCounter counter, int64_t value) {
+  m->counters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+inline void metricsObserve(Metrics *m, MetricHistogram histogram, int64_t us) {
+  Histogram *h = &m->histograms[histogram];
+  int bucket = 0;
+  while (bucket < histogramBuckets - 1 && us > ((int64_t)1 << bucket)) {
+    bucket++;
+  }
+  h->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  h->count.fetch_add(1, std::memory_order_relaxed);
+  h->sum.fetch_add(us, std::memory_order_relaxed);
+}
+
+void metricsReset(Metrics *m);
+void metricsCopy(Metrics *dst, const Metrics *src);
+
+// Writes count metric sets, each one labelled with its programmer serial
+void writeMetricsJson(FILE *f,
+                      const Metrics *const *metrics,
+                      const char *const *labels,
+                      int count);
+void writeMetricsOpenMetrics(FILE *f,
+                             const Metrics *const *metrics,
+                             const char *const *labels,
+                             int count);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "hm05.hpp"
+#include "trace.hpp"
+#include <cstdio>
+#include <mutex>
+
+int traceEnabled = 0;
+
+struct TraceEvent {
+  const char *name;
+  int64_t start;
+  int64_t duration;
+  int64_t bytes;
+};
+
+const int traceChunkEvents = 4096;
+
+struct TraceChunk {
+  TraceEvent events[traceChunkEvents];
+  int count;
+  TraceChunk *next;
+};
+
+// Spans of one thread. Kept after the thread exits until the trace is written.
+struct TraceThread {
+  int tid;
+  char name[64];
+  TraceChunk *first;
+  TraceChunk *last;
+  TraceThread *next;
+};
+
+std::mutex traceMutex; // Guards traceThreads, taken once per thread
+TraceThread *traceThreads = nullptr;
+int traceThreadCount = 0;
+int64_t traceOrigin = 0;
+thread_local TraceThread *currentTraceThread = nullptr;
+
+void traceStart() {
+  traceOrigin = monotonicUs();
+  traceEnabled = 1;
+}
+
+int64_t traceNow() {
+  return monotonicUs();
+}
+
+TraceThread *getTraceThread() {
+  if (currentTraceThread) {
+    return currentTraceThread;
+  }
+
+  TraceThread *tt = new TraceThread();
+  tt->first = tt->last = new TraceChunk();
+  tt->first->count = 0;
+  tt->first->next = nullptr;
+
+  std::lock_guard<std::mutex> lock(traceMutex);
+  tt->tid = ++traceThreadCount;
+  snprintf(tt->name, sizeof(tt->name), "thread %d", tt->tid);
+  tt->next = traceThreads;
+  traceThreads = tt;
+  currentTraceThread = tt;
+  return tt;
+}
+
+void traceEnd(const char *name, int64_t start, int64_t bytes) {
+  if (!start) {
+    return;
+  }
+
+  const int64_t end = monotonicUs();
+  TraceThread *tt = getTraceThread();
+  TraceChunk *chunk = tt->last;
+  if (chunk->count == traceChunkEvents) {
+    chunk = new TraceChunk();
+    chunk->count = 0;
+    chunk->next = nullptr;
+    tt->last->next = chunk;
+    tt->last = chunk;
+  }
+
+  TraceEvent *e = &chunk->events[chunk->count++];
+  e->name = name;
+  e->start = start;
+  e->duration = end - start;
+  e->bytes = bytes;
+}
+
+void traceThreadName(const char *name) {
+  if (!traceEnabled) {
+    return;
+  }
+  TraceThread *tt = getTraceThread();
+  snprintf(tt->name, sizeof(tt->name), "%s", name);
+}
+
+int writeTrace(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    logMessage(LOG_ERROR, "Cannot open file %s for writing", path);
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(traceMutex);
+  const char *separator = "";
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (TraceThread *tt = traceThreads; tt; tt = tt->next) {
+    fprintf(f,
+            "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+            separator,
+            tt->tid,
+            tt->name);
+    separator = ",\n";
+
+    for (TraceChunk *chunk = tt->first; chunk; chunk = chunk->next) {
+      for (int i = 0; i < chunk->count; i++) {
+        const TraceEvent *e = &chunk->events[i];
+        fprintf(f,
+                ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                "\"tid\": %d, \"ts\": %lld, \"dur\": %lld",
+                e->name,
+                tt->tid,
+                (long long)(e->start - traceOrigin),
+                (long long)e->duration);
+        if (e->bytes >= 0) {
+          fprintf(f, ", \"args\": {\"bytes\": %lld}", (long long)e->bytes);
+        }
+        fprintf(f, "}");
+      }
+    }
+  }
+  fprintf(f, "\n]}\n");
+
+  if (fclose(f) != 0) {
+    logMessage(LOG_ERROR, "Unable to write trace to %s", path);
+    return -1;
+  }
+  return 0;
+}
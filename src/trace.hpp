@@ -0,0 +1,52 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+
+// Chrome trace event recording, viewable in Perfetto or chrome://tracing.
+// Spans go to a buffer owned by the calling thread, so recording them takes
+// no lock. All buffers are merged when the trace is written.
+
+extern int traceEnabled; // Set once by traceStart(), before any job thread
+
+void traceStart();
+int64_t traceNow();
+
+// Returns the start of a span, or 0 when tracing is off
+inline int64_t traceBegin() {
+  return traceEnabled ? traceNow() : 0;
+}
+
+// Records the span from start to now. name must outlive the trace, bytes is
+// left out of the arguments when negative.
+void traceEnd(const char *name, int64_t start, int64_t bytes);
+
+// Names the calling thread in the timeline
+void traceThreadName(const char *name);
+
+// Writes every recorded span. Threads must not record while it runs.
+int writeTrace(const char *path);
+
+#endif
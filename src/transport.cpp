@@ -0,0 +1,464 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "hm05.hpp"
+#include "emulator.hpp"
+#include <cstdio>
+#include <cstring>
+
+#define CHIP_VENDOR  0x0403
+#define CHIP_PRODUCT 0x6010
+
+// Timeout used to flush remaining data from the chip buffer, in milliseconds
+const int latencyMs = 2;
+
+#define CALL_FTDI(CMD, ERROR, ...)                                             \
+  {                                                                            \
+    int ret;                                                                   \
+    if ((ret = CMD(ftdi, ##__VA_ARGS__)) < 0) {                                \
+      logMessage(                                                              \
+        LOG_ERROR, "%s: %d (%s)", ERROR, ret, ftdi_get_error_string(ftdi));    \
+      return -1;                                                               \
+    }                                                                          \
+  }
+
+// libftdi backend
+//------------------------------
+
+// Chip to host buffer used for MPSSE answers
+int ftdiRxBufferSize(ftdi_chip_type type) {
+  switch (type) {
+    case TYPE_2232H:
+    case TYPE_4232H:
+      return 4096;
+    case TYPE_232H:
+      return 1024;
+    default:
+      // 2232C/D. 256 is what was always known to work on these.
+      return 256;
+  }
+}
+
+int ftdiSetup(UsbTransport *t) {
+  auto ftdi = (ftdi_context *)t->backend;
+
+  // Steps following the oficial guide to setup MPSSE
+  //------------------------------
+
+  // Reset device
+  CALL_FTDI(ftdi_usb_reset, "Unable to reset device");
+
+  // Set chunk sizes to 64KiB
+  CALL_FTDI(ftdi_write_data_set_chunksize,
+            "Unable to set write chunk size",
+            t->chunkSize);
+  CALL_FTDI(ftdi_read_data_set_chunksize,
+            "Unable to set read chunk size",
+            t->chunkSize);
+
+  // Disable special chars
+  CALL_FTDI(ftdi_set_event_char, "Unable to reset event char", 0, 0);
+  CALL_FTDI(ftdi_set_error_char, "Unable to reset error char", 0, 0);
+
+  // Set timeout that is used to flush remaining data from the receive buffer in
+  // milliseconds.
+  CALL_FTDI(ftdi_set_latency_timer, "Unable to set latency", latencyMs);
+
+  // Turn on flow control so no read requests are generated while buffer is full
+  CALL_FTDI(ftdi_setflowctrl, "Unable to turn on flow control", SIO_RTS_CTS_HS);
+
+  // Reset controller
+  CALL_FTDI(ftdi_set_bitmode, "Unable to reset controller", 0x00, 0x00);
+  // Enable MPSSE mode
+  CALL_FTDI(ftdi_set_bitmode, "Unable to enable MPSSE mode", 0x00, 0x02);
+
+  return 0;
+}
+
+// Longest a single wait blocks in libusb, so signals are not held up
+const int eventSliceUs = 100 * 1000;
+
+// Handles libusb events until tc completes or timeoutUs passes (never if 0),
+// blocking in between. ftdi_transfer_data_done() handles them with a zero
+// timeout instead, which spins a core for the whole transfer, so it is only
+// called once tc completed. Returns whether it did.
+int ftdiAwaitTransfer(ftdi_context *ftdi,
+                      ftdi_transfer_control *tc,
+                      int64_t timeoutUs) {
+  const int64_t deadline = timeoutUs > 0 ? monotonicUs() + timeoutUs : 0;
+
+  while (!tc->completed) {
+    int64_t sliceUs = eventSliceUs;
+    if (deadline) {
+      const int64_t leftUs = deadline - monotonicUs();
+      if (leftUs <= 0) {
+        return 0;
+      }
+      sliceUs = leftUs < sliceUs ? leftUs : sliceUs;
+    }
+
+    timeval timeout = {0, (suseconds_t)sliceUs};
+    const int ret = libusb_handle_events_timeout_completed(
+      ftdi->usb_ctx, &timeout, &tc->completed);
+    // ftdi_transfer_data_done() cancels the transfer and reports the error
+    if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+      return 1;
+    }
+  }
+  return 1;
+}
+
+void *ftdiSubmitWrite(UsbTransport *t, uint8_t *data, int nBytes) {
+  auto ftdi = (ftdi_context *)t->backend;
+
+  ftdi_transfer_control *tc = ftdi_write_data_submit(ftdi, data, nBytes);
+  if (!tc) {
+    logMessage(
+      LOG_ERROR, "Unable to submit write: %s", ftdi_get_error_string(ftdi));
+  }
+  return tc;
+}
+
+int ftdiWaitWrite(UsbTransport *t, void *transfer) {
+  auto ftdi = (ftdi_context *)t->backend;
+
+  auto tc = (ftdi_transfer_control *)transfer;
+  ftdiAwaitTransfer(ftdi, tc, 0);
+  const int ret = ftdi_transfer_data_done(tc);
+  if (ret < 0) {
+    logMessage(LOG_ERROR,
+               "%s: %d (%s)",
+               "Unable to write data to device",
+               ret,
+               ftdi_get_error_string(ftdi));
+    return -1;
+  }
+  return 0;
+}
+
+void ftdiCancelWrite(UsbTransport *, void *transfer) {
+  timeval timeout = {0, 100 * 1000};
+  ftdi_transfer_data_cancel((ftdi_transfer_control *)transfer, &timeout);
+}
+
+int ftdiRead(UsbTransport *t, uint8_t *dst, int nBytes) {
+  auto ftdi = (ftdi_context *)t->backend;
+
+  ftdi_transfer_control *tc = ftdi_read_data_submit(ftdi, dst, nBytes);
+  if (!tc) {
+    logMessage(
+      LOG_ERROR, "Unable to submit read: %s", ftdi_get_error_string(ftdi));
+    return -1;
+  }
+
+  ftdiAwaitTransfer(ftdi, tc, 0);
+  const int ret = ftdi_transfer_data_done(tc);
+  if (ret < 0) {
+    logMessage(LOG_ERROR,
+               "%s: %d (%s)",
+               "Unable to read data",
+               ret,
+               ftdi_get_error_string(ftdi));
+    return -1;
+  }
+  if (ret != nBytes) {
+    logMessage(LOG_ERROR, "Short read: %d of %d bytes", ret, nBytes);
+    return -1;
+  }
+  return nBytes;
+}
+
+// Whatever the chip holds comes in within a latency timer period. The read
+// asks for more than the chip buffer, so it never completes and is cancelled
+// once the period is over.
+int ftdiDrain(UsbTransport *t) {
+  auto ftdi = (ftdi_context *)t->backend;
+  uint8_t *buff = new uint8_t[t->rxBufferSize + 1];
+
+  ftdi_transfer_control *tc =
+    ftdi_read_data_submit(ftdi, buff, t->rxBufferSize + 1);
+  if (!tc) {
+    logMessage(
+      LOG_ERROR, "Unable to submit read: %s", ftdi_get_error_string(ftdi));
+    delete[] buff;
+    return -1;
+  }
+
+  int bytesRead;
+  if (ftdiAwaitTransfer(ftdi, tc, (latencyMs + 1) * 1000)) {
+    bytesRead = ftdi_transfer_data_done(tc);
+  } else {
+    bytesRead = tc->offset;
+    timeval timeout = {0, eventSliceUs};
+    ftdi_transfer_data_cancel(tc, &timeout);
+  }
+  delete[] buff;
+
+  if (bytesRead < 0) {
+    logMessage(LOG_ERROR,
+               "%s: %d (%s)",
+               "Unable to read data",
+               bytesRead,
+               ftdi_get_error_string(ftdi));
+    return -1;
+  }
+  return bytesRead;
+}
+
+void ftdiClose(UsbTransport *t) {
+  auto ftdi = (ftdi_context *)t->backend;
+  ftdi_usb_close(ftdi);
+  ftdi_free(ftdi);
+}
+
+const TransportOps ftdiOps = {ftdiSetup,
+                              ftdiSubmitWrite,
+                              ftdiWaitWrite,
+                              ftdiCancelWrite,
+                              ftdiRead,
+                              ftdiDrain,
+                              ftdiClose};
+
+int listProgrammers(ProgrammerInfo *dst, int maxCount) {
+  ftdi_context *ftdi = ftdi_new();
+  if (!ftdi) {
+    return -1;
+  }
+
+  ftdi_device_list *devices;
+  const int ret = ftdi_usb_find_all(ftdi, &devices, CHIP_VENDOR, CHIP_PRODUCT);
+  if (ret < 0) {
+    logMessage(LOG_ERROR,
+               "Unable to list ftdi devices: %d (%s)",
+               ret,
+               ftdi_get_error_string(ftdi));
+    ftdi_free(ftdi);
+    return -1;
+  }
+
+  int count = 0;
+  for (ftdi_device_list *d = devices; d && count < maxCount; d = d->next) {
+    ProgrammerInfo *info = &dst[count++];
+    info->serial[0] = 0;
+    ftdi_usb_get_strings(ftdi,
+                         d->dev,
+                         nullptr,
+                         0,
+                         nullptr,
+                         0,
+                         info->serial,
+                         sizeof(info->serial));
+    snprintf(info->busPath,
+             sizeof(info->busPath),
+             "%03d/%03d",
+             libusb_get_bus_number(d->dev),
+             libusb_get_device_address(d->dev));
+  }
+
+  ftdi_list_free(&devices);
+  ftdi_free(ftdi);
+  return count;
+}
+
+// Opens the programmer given as serial or BBB/DDD bus path, or the first one
+// found when device is null
+int openProgrammer(struct ftdi_context *ftdi, const char *device) {
+  char description[128];
+
+  if (!device) {
+    return ftdi_usb_open(ftdi, CHIP_VENDOR, CHIP_PRODUCT);
+  }
+
+  int bus, address;
+  char end;
+  if (sscanf(device, "%d/%d%c", &bus, &address, &end) == 2) {
+    snprintf(description, sizeof(description), "d:%03d/%03d", bus, address);
+  } else {
+    snprintf(description,
+             sizeof(description),
+             "s:0x%04x:0x%04x:%s",
+             CHIP_VENDOR,
+             CHIP_PRODUCT,
+             device);
+  }
+  return ftdi_usb_open_string(ftdi, description);
+}
+
+int ftdiOpen(UsbTransport *t, const char *device) {
+  ftdi_context *ftdi = ftdi_new();
+  if (!ftdi) {
+    return -1;
+  }
+
+  ftdi->usb_write_timeout = 10000;
+  ftdi->usb_read_timeout = 10000;
+
+  int ret;
+  if ((ret = openProgrammer(ftdi, device)) != 0) {
+    logMessage(LOG_ERROR,
+               "Unable to open ftdi device %s: %d (%s)",
+               device ? device : "",
+               ret,
+               ftdi_get_error_string(ftdi));
+    ftdi_free(ftdi);
+    return -1;
+  }
+
+  t->ops = &ftdiOps;
+  t->backend = ftdi;
+  t->serial[0] = 0;
+  ftdi_usb_get_strings(ftdi,
+                       libusb_get_device(ftdi->usb_dev),
+                       nullptr,
+                       0,
+                       nullptr,
+                       0,
+                       t->serial,
+                       sizeof(t->serial));
+  t->chipType = ftdi->type;
+  t->maxPacketSize = ftdi->max_packet_size;
+  t->rxBufferSize = ftdiRxBufferSize(ftdi->type);
+  return 0;
+}
+
+// Backend independent part
+//------------------------------
+
+int transportOpen(UsbTransport *t,
+                  const char *device,
+                  int queueDepth,
+                  int chunkSize) {
+  if (queueDepth < 1) {
+    queueDepth = 1;
+  }
+  if (queueDepth > MAX_USB_QUEUE_DEPTH) {
+    queueDepth = MAX_USB_QUEUE_DEPTH;
+  }
+
+  t->ops = nullptr;
+  t->inFlightHead = 0;
+  t->inFlightCount = 0;
+  t->submittedWrites = 0;
+  t->completedWrites = 0;
+  t->queueDepth = queueDepth;
+
+  const int ret = isEmulatorDevice(device) ? emulatorOpen(t, device)
+                                           : ftdiOpen(t, device);
+  if (ret < 0) {
+    return -1;
+  }
+
+  // Whole packets only, so no short packet ends a transfer early
+  if (t->maxPacketSize > 0 && chunkSize > t->maxPacketSize) {
+    chunkSize -= chunkSize % t->maxPacketSize;
+  }
+  t->chunkSize = chunkSize;
+  return 0;
+}
+
+int transportSetup(UsbTransport *t) {
+  return t->ops->setup(t);
+}
+
+int waitOldestWrite(UsbTransport *t) {
+  assert(t->inFlightCount > 0);
+
+  void *transfer = t->inFlight[t->inFlightHead];
+  t->inFlightHead = (t->inFlightHead + 1) % MAX_USB_QUEUE_DEPTH;
+  t->inFlightCount--;
+  t->completedWrites++;
+
+  if (t->ops->waitWrite(t, transfer) < 0) {
+    transportCancel(t);
+    return -1;
+  }
+  return 0;
+}
+
+int transportWrite(UsbTransport *t, uint8_t *data, int nBytes) {
+  while (nBytes > 0) {
+    const int chunk = nBytes > t->chunkSize ? t->chunkSize : nBytes;
+
+    if (t->inFlightCount == t->queueDepth && waitOldestWrite(t) < 0) {
+      return -1;
+    }
+
+    void *transfer = t->ops->submitWrite(t, data, chunk);
+    if (!transfer) {
+      transportCancel(t);
+      return -1;
+    }
+
+    const int tail = (t->inFlightHead + t->inFlightCount) % MAX_USB_QUEUE_DEPTH;
+    t->inFlight[tail] = transfer;
+    t->inFlightCount++;
+    t->submittedWrites++;
+
+    data += chunk;
+    nBytes -= chunk;
+  }
+  return 0;
+}
+
+int transportWaitWrites(UsbTransport *t) {
+  while (t->inFlightCount > 0) {
+    if (waitOldestWrite(t) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int transportWaitWritesUntil(UsbTransport *t, int64_t nWrites) {
+  while (t->completedWrites < nWrites) {
+    if (waitOldestWrite(t) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int transportRead(UsbTransport *t, uint8_t *dst, int nBytes) {
+  return t->ops->read(t, dst, nBytes);
+}
+
+int transportDrain(UsbTransport *t) {
+  return t->ops->drain(t);
+}
+
+void transportCancel(UsbTransport *t) {
+  while (t->inFlightCount > 0) {
+    t->ops->cancelWrite(t, t->inFlight[t->inFlightHead]);
+    t->inFlightHead = (t->inFlightHead + 1) % MAX_USB_QUEUE_DEPTH;
+    t->inFlightCount--;
+    t->completedWrites++;
+  }
+}
+
+void transportClose(UsbTransport *t) {
+  if (!t->ops) {
+    return;
+  }
+  transportCancel(t);
+  t->ops->close(t);
+  t->ops = nullptr;
+}
@@ -0,0 +1,99 @@
+/*
+Copyright (c) 2021 Miguel Ángel Pérez Martínez
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <ftdi.h>
+#include <cstdint>
+
+#define DEFAULT_USB_QUEUE_DEPTH 4
+#define MAX_USB_QUEUE_DEPTH     32
+
+struct UsbTransport;
+
+// Backend behind a UsbTransport, either libftdi or the emulator
+struct TransportOps {
+  // Puts the link in MPSSE mode
+  int (*setup)(UsbTransport *t);
+  // Starts sending nBytes, returns a handle for waitWrite() or null on errors
+  void *(*submitWrite)(UsbTransport *t, uint8_t *data, int nBytes);
+  int (*waitWrite)(UsbTransport *t, void *transfer);
+  void (*cancelWrite)(UsbTransport *t, void *transfer);
+  // Waits until exactly nBytes were received into dst
+  int (*read)(UsbTransport *t, uint8_t *dst, int nBytes);
+  // Drops anything received so far. Returns the bytes dropped.
+  int (*drain)(UsbTransport *t);
+  void (*close)(UsbTransport *t);
+};
+
+// Asynchronous transport to the programmer's MPSSE. Writes are split in
+// chunkSize transfers and up to queueDepth of them are kept in flight.
+// Completions are waited on (libusb event handling), never polled.
+struct UsbTransport {
+  const TransportOps *ops;
+  void *backend;    // ftdi_context or Emulator
+  char serial[64];  // Programmer serial number
+  int chipType;     // ftdi_chip_type
+  int maxPacketSize;
+  int rxBufferSize; // Chip to host buffer used for MPSSE answers
+  int chunkSize;    // Max bytes per submitted transfer
+  int queueDepth;   // Max transfers in flight
+  void *inFlight[MAX_USB_QUEUE_DEPTH];
+  int inFlightHead;
+  int inFlightCount;
+  int64_t submittedWrites; // Transfers submitted so far
+  int64_t completedWrites; // Transfers finished so far, in submit order
+};
+
+// Opens the programmer selected by device: a serial number, a BBB/DDD bus
+// path, or "emu[:options]" for the emulator (see emulator.hpp). A null device
+// opens the first programmer found.
+int transportOpen(UsbTransport *t,
+                  const char *device,
+                  int queueDepth,
+                  int chunkSize);
+
+int transportSetup(UsbTransport *t);
+
+// Submits nBytes from data. Only blocks while the queue is full. data must
+// not be modified until transportWaitWrites() returns.
+int transportWrite(UsbTransport *t, uint8_t *data, int nBytes);
+
+// Waits until every submitted write has completed
+int transportWaitWrites(UsbTransport *t);
+
+// Waits until the first nWrites submitted writes have completed
+int transportWaitWritesUntil(UsbTransport *t, int64_t nWrites);
+
+// Waits until exactly nBytes were received into dst
+int transportRead(UsbTransport *t, uint8_t *dst, int nBytes);
+
+// Drops received data nobody asked for. Returns the bytes dropped or -1.
+int transportDrain(UsbTransport *t);
+
+// Drops pending writes without waiting for them, used on error paths
+void transportCancel(UsbTransport *t);
+
+void transportClose(UsbTransport *t);
+
+#endif